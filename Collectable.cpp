@@ -1,4 +1,5 @@
 #include "Collectable.h"
+#include "CollectableHash.h"
 
 namespace GC {
 	ScanLists* ScanListsByThread[MAX_COLLECTED_THREADS];
@@ -10,3 +11,89 @@ void InstancePtrBase::mark()
     Collectable* s = get_collectable();
     if (s!= collectable_null) s->collectable_mark();
 }
+
+namespace GC {
+    //The strings made by intern(), found by their bytes.  Entries are handles rather than InstancePtrs so that the table
+    //doesn't keep the strings alive, clear_dying() takes out the ones the collector is about to free.
+    class InternTable : public WeakHolder
+    {
+        struct Entry
+        {
+            uint64_t hash;
+            std::atomic<Handle> handle;
+        };
+        std::mutex lock;
+        SwissHash::Control control;
+        std::unique_ptr<Entry[]> entries;
+        int used;
+
+        static CollectableString* string_at(Handle h) { return static_cast<CollectableString*>(Handles[h].ptr); }
+        void rehash(int capacity)
+        {
+            SwissHash::Control c(capacity);
+            std::unique_ptr<Entry[]> e(new Entry[capacity]);
+            for (int i = 0; i < control.capacity; ++i) {
+                if (!control.full(i)) continue;
+                uint32_t h = SwissHash::mix(entries[i].hash);
+                int j = c.find_free(h);
+                c.claim(j, h);
+                e[j].hash = entries[i].hash;
+                e[j].handle.store(entries[i].handle.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            control = std::move(c);
+            entries = std::move(e);
+        }
+    public:
+        InternTable() :control(64), entries(new Entry[64]), used(0) { weak_register(); }
+        ~InternTable() { weak_unregister(); }
+
+        RootPtr<CollectableString> intern(const char* s, int len)
+        {
+            uint64_t hash = CollectableString::hash_bytes(s, len);
+            uint32_t h = SwissHash::mix(hash);
+            if (!lock.try_lock()) {
+                LeaveMutationRAII leave;
+                lock.lock();
+            }
+            std::lock_guard<std::mutex> g(lock, std::adopt_lock);
+            CollectableString* found = nullptr;
+            control.find(h, [&](int i) {
+                if (entries[i].hash != hash) return false;
+                CollectableString* c = string_at(entries[i].handle.load(std::memory_order_relaxed));
+                if (c->length != len || memcmp(c->str(), s, len) != 0) return false;
+                //a string that's dying stays in the table until clear_dying(), but it can't be handed out
+                Handle live = weak_load(entries[i].handle);
+                if (live == NULLHandle) return false;
+                found = string_at(live);
+                return true;
+            });
+            if (found != nullptr) return RootPtr<CollectableString>(found);
+            if (control.growth_left == 0) rehash(control.next_capacity(used));
+            CollectableString* c = CollectableString::make(s, len);
+            c->interned = true;
+            c->hash_cache.store(hash, std::memory_order_relaxed);
+            int i = control.find_free(h);
+            control.claim(i, h);
+            entries[i].hash = hash;
+            entries[i].handle.store(c->getHandle(), std::memory_order_relaxed);
+            ++used;
+            return RootPtr<CollectableString>(c);
+        }
+        void clear_dying()
+        {
+            std::lock_guard<std::mutex> g(lock);
+            for (int i = 0; i < control.capacity; ++i) {
+                if (control.full(i) && weak_clear_if_dying(entries[i].handle)) {
+                    control.erase(i);
+                    --used;
+                }
+            }
+        }
+    };
+
+    RootPtr<CollectableString> intern(const char* s, int len)
+    {
+        static InternTable table;
+        return table.intern(s, len);
+    }
+}
@@ -1,7 +1,9 @@
 #pragma once
 #include "GCState.h"
 #include "spooky.h"
+#include <deque>
 #include <iostream>
+#include <vector>
 
 //#define ENSURE_THROW(cond, exception)	\
 //	do { int __afx_condVal=!!(cond); assert(__afx_condVal); if (!(__afx_condVal)){exception;} } while (false)
@@ -10,6 +12,7 @@
 enum _before_ { _BEFORE_, _END_ };
 enum _after_ { _AFTER_, _START_ };
 enum _sentinel_ { _SENTINEL_ };
+enum _leaf_ { _LEAF_ };
 
 class CircularDoubleList;
 
@@ -48,6 +51,21 @@ public:
             delete center; 
             return *this; 
         }
+        //takes center out of the list without deleting it, linked to itself so that its destructor has nothing left to unlink
+        circular_double_list_iterator& unlink() {
+            center->disconnect();
+            center->circular_double_list_prev = center->circular_double_list_next = center;
+            return *this;
+        }
+        //takes center out of its list and puts it at the start of the list whose sentinel is e
+        circular_double_list_iterator& move_to(CircularDoubleList* e) {
+            center->disconnect();
+            center->circular_double_list_prev = e;
+            center->circular_double_list_next = e->circular_double_list_next;
+            e->circular_double_list_next->circular_double_list_prev = center;
+            e->circular_double_list_next = center;
+            return *this;
+        }
 
         CircularDoubleList& operator*() { return *center; }
         bool operator ++() { center = next; prev = center->circular_double_list_prev; next = center->circular_double_list_next;  return !center->sentinel(); }
@@ -76,7 +94,7 @@ public:
     CircularDoubleList(CircularDoubleList&&) = delete;
     CircularDoubleList() = delete;
 
-    bool empty() { return circular_double_list_next == circular_double_list_prev; }
+    bool empty() { return circular_double_list_next == this; }
 };
 inline void merge_from_to(CircularDoubleList* source, CircularDoubleList* dest) {
     assert(source->sentinel());
@@ -108,7 +126,7 @@ template <typename T>
 class InstancePtr : public InstancePtrBase
 {
 //    void double_ptr_store( T* const v) { GC::double_ptr_store(&value, v == nullptr ? GC::NULLHandle : v->getHandle()); }
-    void double_ptr_store(const T* v) { GC::double_ptr_store(&value, v->getHandle()); }
+    void construct_ptr(const T* v) { GC::construct_ptr(&value, v->getHandle()); }
 public:
 
     GC::Handle getHandle() const { return GC::load(&value); }
@@ -116,19 +134,39 @@ public:
 
 //    void store(T* const v) { GC::write_barrier(&value, v == nullptr ? GC::NULLHandle : v->getHandle()); }
     void store( T* const v) { GC::write_barrier(&value, v->getHandle()); }
+
+    //atomic versions for sharing a pointer between threads without a lock, see GC::compare_exchange_ptr
+    T* load(std::memory_order order) const { return (T*)GC::Handles[GC::atomic_load_ptr(&value, order)].ptr; }
+    void store(T* const v, std::memory_order order) { GC::atomic_store_ptr(GC::ThreadContext, &value, v->getHandle(), order); }
+    T* exchange(T* const v, std::memory_order order = std::memory_order_seq_cst)
+    {
+        return (T*)GC::Handles[GC::exchange_ptr(GC::ThreadContext, &value, v->getHandle(), order)].ptr;
+    }
+    bool compare_exchange(T*& expected, T* const desired, std::memory_order order = std::memory_order_seq_cst)
+    {
+        GC::Handle e = expected->getHandle();
+        if (GC::compare_exchange_ptr(GC::ThreadContext, &value, e, desired->getHandle(), order)) return true;
+        expected = (T*)GC::Handles[e].ptr;
+        return false;
+    }
     template<typename U>
     auto operator[](U i) const { return (*get())[i]; }
     T& operator*() const { return *get(); }
     T* operator -> () const { return get(); }
 
-    InstancePtr() { GC::double_ptr_store(&value, GC::NULLHandle); }
+    InstancePtr() { GC::construct_ptr(&value, GC::NULLHandle); }
  //   InstancePtr(GC::Handle const v) { double_ptr_store( v); }
 
     
-    explicit InstancePtr(const T*  v) { double_ptr_store( v); }
+    explicit InstancePtr(const T*  v) { construct_ptr( v); }
 
     explicit InstancePtr(const InstancePtr<T>& o) {
-        double_ptr_store(o.get());
+        construct_ptr(o.get());
+    }
+    //lets std algorithms like sort hold an element in a temporary while they shuffle an array.  a temporary off the heap
+    //isn't traced, so it's only good until the next safe point
+    InstancePtr(InstancePtr<T>&& o) {
+        construct_ptr(o.get());
     }
 
     void operator = (T *const o) {
@@ -144,6 +182,28 @@ public:
     void operator = (const RootPtr<T>& o);
 };
 
+//Typed front ends for the bulk barrier stores, for arrays of InstancePtr.  They rely on an InstancePtr being nothing but its SnapPtr.
+namespace GC {
+    template <typename T>
+    void copy_range(InstancePtr<T>* dest, const InstancePtr<T>* src, int n)
+    {
+        static_assert(sizeof(InstancePtr<T>) == sizeof(SnapPtr), "InstancePtr arrays have to be SnapPtr arrays");
+        if (n > 0) copy_range(&dest->value, &src->value, n);
+    }
+    template <typename T>
+    void move_range(InstancePtr<T>* dest, const InstancePtr<T>* src, int n)
+    {
+        static_assert(sizeof(InstancePtr<T>) == sizeof(SnapPtr), "InstancePtr arrays have to be SnapPtr arrays");
+        if (n > 0) move_range(&dest->value, &src->value, n);
+    }
+    template <typename T>
+    void fill_range(InstancePtr<T>* dest, const T* v, int n)
+    {
+        static_assert(sizeof(InstancePtr<T>) == sizeof(SnapPtr), "InstancePtr arrays have to be SnapPtr arrays");
+        if (n > 0) fill_range(&dest->value, v->getHandle(), n);
+    }
+}
+
 template< class T, class U >
 RootPtr<T> static_pointer_cast(const InstancePtr<U>& v) noexcept
 {
@@ -177,11 +237,20 @@ struct RootLetterBase;
 //collectables[2] holds the sublist of objects that existed during the collection phase (when the write barrier didn't write the snapshot) even after the lists are merged so that the 
 //the lists are scanned in order to restore the snapshot, no time is wasted on objects created AFTER the double write barrier was restored.
 //the same goes for roots[ActiveIndex] and roots[2] but for root variables instead of objects
+//first_fresh_collectable and first_fresh_root mark where the objects and roots created during the collection phase start in the
+//merged lists.  Their snapshots already match (see GC::construct_ptr) so the restore passes stop there.
+//leaves[ActiveIndex] and leaves[ActiveIndex^1] are the same for CollectableLeaf objects, which have no pointers so the restore
+//passes never need to see them.
+//frozen holds the objects the sweep has moved out of the other lists after GC::freeze(), nothing walks it.
 namespace GC {
     struct ScanLists
     {
         Collectable* collectables[3];
+        Collectable* leaves[2];
+        Collectable* frozen;
         RootLetterBase* roots[3];
+        Collectable* first_fresh_collectable;
+        RootLetterBase* first_fresh_root;
     };
 
     extern ScanLists* ScanListsByThread[MAX_COLLECTED_THREADS];
@@ -224,7 +293,7 @@ struct RootLetterBase : public CircularDoubleList
     }
 };
 
-inline RootLetterBase::RootLetterBase():CircularDoubleList(_START_,GC::ScanListsByThread[GC::MyThreadNumber]->roots[GC::ActiveIndex]),owned(true),was_owned(true)
+inline RootLetterBase::RootLetterBase():CircularDoubleList(_START_,(assert(GC::ThreadContext != &GC::FinalizerContext), GC::ThreadContext->scan_lists->roots[GC::ActiveIndex])),owned(true),was_owned(true)
 #ifndef NDEBUG
 ,deleted(false)
 #endif
@@ -343,15 +412,16 @@ struct RootPtr
         GC::log_alloc(sizeof(*var));
     }
     ~RootPtr() { 
+        assert(GC::ThreadContext != &GC::FinalizerContext);
         var->owned = false; 
-        if (GC::ThreadState != GC::PhaseEnum::COLLECTING) var->was_owned = false;
+        if (GC::ThreadContext->phase != GC::PhaseEnum::COLLECTING) var->was_owned = false;
     }
 };
 
 template<typename T>
 InstancePtr<T>::InstancePtr(const RootPtr<T>& o)
 {
-    double_ptr_store(o.get());
+    construct_ptr(o.get());
 }
 
 template<typename T>
@@ -404,6 +474,10 @@ namespace GC {
     void _do_restore_snapshot();
     void _end_collection_start_restore_snapshot();
     void _do_finalize_snapshot();
+    void clear_weak_references();
+    void freeze_requested();
+    bool is_dying(const Collectable* c);
+    bool is_marked(const Collectable* c);
 }
 
 enum class CollectableEqualityClass
@@ -421,6 +495,10 @@ protected:
     friend void GC::_do_restore_snapshot();
     friend void GC::_end_collection_start_restore_snapshot();
     friend void GC::_do_finalize_snapshot();
+    friend void GC::clear_weak_references();
+    friend void GC::freeze_requested();
+    friend bool GC::is_dying(const Collectable* c);
+    friend bool GC::is_marked(const Collectable* c);
 //public:
 //    bool deleted;
 protected:
@@ -435,11 +513,23 @@ protected:
 #else
     std::atomic_bool marked;
 #endif
-    virtual ~Collectable() 
-    {
-        GC::DeallocHandleInGC(myHandle);
-    }
-    Collectable(_sentinel_) : CircularDoubleList(_SENTINEL_), collectable_back_ptr(collectable_null) , collectable_marked(false), myHandle(GC::AllocateHandle())
+    //unmarked and in the list being swept, only set while weak references are being cleared, see GC::WeakHolder
+    bool collectable_condemned : 1;
+    //the marker doesn't look at this object's instance variables, but the restore passes do, see EphemeronBlock
+    bool collectable_untraced : 1;
+private:
+    template <typename, typename, typename...> friend class TriviallyFinalized;
+    //only set by TriviallyFinalized, the finalizer then frees the memory without calling the destructor
+    bool collectable_trivial_destructor : 1;
+protected:
+    //a CollectableLeaf, the marker only sets its mark
+    bool collectable_leaf : 1;
+    //frozen by GC::freeze(), marked from then on and never swept
+    bool collectable_frozen : 1;
+    //the sweep frees the handle, the destructor runs later on the finalizer thread, when the handle may already have
+    //been reused, so destructors mustn't use myHandle, see GC::finalize
+    virtual ~Collectable() {}
+    Collectable(_sentinel_) : CircularDoubleList(_SENTINEL_), collectable_back_ptr(collectable_null) , collectable_marked(false), collectable_condemned(false), collectable_untraced(false), collectable_trivial_destructor(false), collectable_leaf(false), collectable_frozen(false), myHandle(GC::AllocateHandle())
 #ifndef NDEBUG
         ,deleted(0)
 #endif
@@ -475,6 +565,12 @@ public:
 
 #endif
     GC::Handle getHandle() const { return myHandle; }
+    //for the finalizer, after the sweep has unlinked it and freed its handle
+    void collectable_finalize()
+    {
+        if (collectable_trivial_destructor) ::operator delete((void*)this);
+        else delete this;
+    }
     //to keep from blowing the stack when marking a long chain, this is coded as a loop instead of being recursive and back pointers and context
     //is stored in the objects themselves instead of on the stack.
     void collectable_mark()
@@ -491,7 +587,7 @@ public:
         bool got_it = marked.exchange(true);
         if (!got_it) {
 #endif
-            int t = total_instance_vars() - 1;
+            int t = collectable_untraced || collectable_leaf ? -1 : total_instance_vars() - 1;
             for (;;) {
                 if (t >= 0) {
                     InstancePtrBase* b = c->index_into_instance_vars(t);
@@ -502,7 +598,8 @@ public:
                             if (n->deleted) std::cout << '*';
 #endif
 
-                            if (!n->collectable_marked) {
+                            if (n->collectable_leaf) n->collectable_marked = true;
+                            else if (!n->collectable_marked) {
 #ifdef ONE_COLLECT_THREAD
                                 n->collectable_marked = true;
                                 {
@@ -513,7 +610,7 @@ public:
                                     n->collectable_back_ptr_from_counter = t;
                                     n->collectable_back_ptr = c;
                                     c = n;
-                                    t = c->total_instance_vars() - 1;
+                                    t = c->collectable_untraced ? -1 : c->total_instance_vars() - 1;
                                     continue;
                                 }
                             }
@@ -553,35 +650,340 @@ public:
     }
     Collectable(Collectable&&) = delete;
 
-    Collectable() :CircularDoubleList(_START_, GC::ScanListsByThread[GC::MyThreadNumber]->collectables[GC::ActiveIndex]), collectable_back_ptr(collectable_null), collectable_marked(false), myHandle(GC::AllocateHandle())
+    Collectable() :CircularDoubleList(_START_, GC::ThreadContext->scan_lists->collectables[GC::ActiveIndex]), collectable_back_ptr(collectable_null), collectable_marked(false), collectable_condemned(false), collectable_untraced(false), collectable_trivial_destructor(false), collectable_leaf(false), collectable_frozen(false), myHandle(GC::AllocateHandle())
 #ifndef NDEBUG
         ,deleted(false)
 #endif
     {
        GC::Handles[myHandle].ptr = this;
     }
+protected:
+    //for CollectableLeaf
+    Collectable(_leaf_) :CircularDoubleList(_START_, GC::ThreadContext->scan_lists->leaves[GC::ActiveIndex]), collectable_back_ptr(collectable_null), collectable_marked(false), collectable_condemned(false), collectable_untraced(false), collectable_trivial_destructor(false), collectable_leaf(true), collectable_frozen(false), myHandle(GC::AllocateHandle())
+#ifndef NDEBUG
+        ,deleted(false)
+#endif
+    {
+       GC::Handles[myHandle].ptr = this;
+    }
+};
 
+/* Leaf objects.
+*
+A collectable with no pointers to other collectables can derive from CollectableLeaf instead of Collectable.  Leaves are
+kept in their own lists (ScanLists::leaves), the marker sets their mark without calling into them and the restore passes
+never walk them, so a heap full of strings costs the restore passes nothing.  total_instance_vars() and
+index_into_instance_vars() are final here, so a leaf type can't declare anything for the collector to trace.
+*/
+class CollectableLeaf : public Collectable
+{
+protected:
+    CollectableLeaf() :Collectable(_LEAF_) {}
+public:
+    virtual int total_instance_vars() const final { return 0; }
+    virtual InstancePtrBase* index_into_instance_vars(int num) final { return nullptr; }
 };
-struct CollectableString : public Collectable
+
+/* Frozen objects.
+*
+GC::freeze(root) freezes everything reachable from root, for data that never changes after it's built.  It takes effect
+at the next collection: from then on the objects are marked for good, so the marker stops at them, weak references to
+them are never cleared, and the sweep moves them out of the lists the restore passes walk into ScanLists::frozen.  They
+are never freed.  A store into a pointer of a frozen object is rejected with std::logic_error, the pointer keeps its value.
+The request holds its own root on root until the collector has handled it, so the caller doesn't have to keep one.
+GC::make_immortal(c) is freeze(c), for singletons.  Whatever c points at is frozen along with it.
+*/
+namespace GC {
+    void freeze(Collectable* root);
+    void make_immortal(Collectable* c);
+}
+
+/* Weak references.
+*
+A WeakHolder keeps handles of collectables without keeping the objects alive.  Between marking and sweeping, the
+collector calls clear_dying() on every WeakHolder there is, and it has to drop every handle whose object is_dying(),
+which weak_clear_if_dying() does for one slot.  The collector can run clear_dying() while mutators are using the
+holder, so the holder has to do its own locking.
+Mutators read the slots with weak_load().  While the collector is marking, an object read that way is marked too, once
+marking is over weak_load() gives null for the objects that are dying even before their slots have been cleared.
+ */
+namespace GC {
+    class WeakHolder
+    {
+        friend void clear_weak_references();
+        WeakHolder* weak_prev;
+        WeakHolder* weak_next;
+        int weak_list;
+        bool weak_registered;
+    protected:
+        //The collector can call clear_dying() as soon as a holder is registered and until it isn't, so a derived
+        //constructor calls weak_register() once everything is set up and its destructor calls weak_unregister() first.
+        void weak_register();
+        void weak_unregister();
+    public:
+        WeakHolder() :weak_prev(nullptr), weak_next(nullptr), weak_list(0), weak_registered(false) {}
+        WeakHolder(const WeakHolder&) = delete;
+        virtual ~WeakHolder() { weak_unregister(); }
+        virtual void clear_dying() = 0;
+        //Called before clear_dying(), over and over until no holder marks anything more.  A holder with ephemerons,
+        //pointers that should only be traced while something else is marked, marks them here from the snapshot and
+        //returns true if it marked anything.
+        virtual bool mark_ephemerons() { return false; }
+    };
+
+    //only meaningful inside clear_dying()
+    inline bool is_dying(const Collectable* c) { return c->collectable_condemned && !c->collectable_marked; }
+    inline bool is_dying(Handle h) { return is_dying(Handles[h].ptr); }
+    //for mark_ephemerons()
+    inline bool is_marked(const Collectable* c) { return c->collectable_marked; }
+    //for clear_dying(), returns true if it cleared the slot
+    inline bool weak_clear_if_dying(std::atomic<Handle>& slot)
+    {
+        Handle h = slot.load(std::memory_order_seq_cst);
+        return h != NULLHandle && is_dying(h) && slot.compare_exchange_strong(h, NULLHandle, std::memory_order_seq_cst);
+    }
+    Handle weak_load_collecting(const std::atomic<Handle>& slot);
+    Handle weak_read_collecting(Handle h);
+    //for a handle that was read out of a weak slot while holding a lock that clear_dying() also takes, the same as weak_load()
+    inline Handle weak_read(Handle h)
+    {
+        if (ThreadContext->phase != PhaseEnum::COLLECTING || h == NULLHandle) return h;
+        return weak_read_collecting(h);
+    }
+    inline Handle weak_load(const std::atomic<Handle>& slot)
+    {
+        if (ThreadContext->phase != PhaseEnum::COLLECTING) return slot.load(std::memory_order_acquire);
+        return weak_load_collecting(slot);
+    }
+}
+
+//Where WeakPtrs made with a queue report being cleared.  The collector pushes the token each one was made with, for
+//instance the key of the cache entry it was in, and mutators take them off with poll(), oldest first.  The queue has to
+//outlive its WeakPtrs.
+class WeakQueue
 {
-    char* str;
-    CollectableString(const char* s) :str(_strdup(s)) { log_size(sizeof(this)+strlen(s)); }
-    ~CollectableString() { free (str); }
-    virtual int total_instance_vars() const { return 0; }
+    std::mutex lock;
+    std::deque<intptr_t> cleared;
+public:
+    void push(intptr_t token)
+    {
+        std::lock_guard<std::mutex> g(lock);
+        cleared.push_back(token);
+    }
+    bool poll(intptr_t& token)
+    {
+        std::lock_guard<std::mutex> g(lock);
+        if (cleared.empty()) return false;
+        token = cleared.front();
+        cleared.pop_front();
+        return true;
+    }
+    size_t size()
+    {
+        std::lock_guard<std::mutex> g(lock);
+        return cleared.size();
+    }
+};
+
+//Points at a collectable without keeping it alive.  When the collector finds nothing else does, it sets the WeakPtr
+//to null between marking and sweeping, and pushes its token on its queue if it has one.  It isn't an instance variable
+//as far as the collector is concerned, so a collectable that has one doesn't count it in total_instance_vars().
+//get() gives null as soon as marking is over if the target is going to be freed, and what it does return is safe
+//until the next safe point, like any raw pointer.  lock() gives a RootPtr to hold it longer.
+template <typename T>
+class WeakPtr : public GC::WeakHolder
+{
+    std::atomic<GC::Handle> target;
+    WeakQueue* queue;
+    intptr_t token;
+public:
+    WeakPtr() :target(GC::NULLHandle), queue(nullptr), token(0) { weak_register(); }
+    WeakPtr(const T* o, WeakQueue* q = nullptr, intptr_t t = 0) :target(o->getHandle()), queue(q), token(t) { weak_register(); }
+    WeakPtr(const RootPtr<T>& o, WeakQueue* q = nullptr, intptr_t t = 0) :WeakPtr(o.get(), q, t) {}
+    WeakPtr(const InstancePtr<T>& o, WeakQueue* q = nullptr, intptr_t t = 0) :WeakPtr(o.get(), q, t) {}
+    WeakPtr(const WeakPtr<T>& o) :target(GC::weak_load(o.target)), queue(o.queue), token(o.token) { weak_register(); }
+    ~WeakPtr() { weak_unregister(); }
+
+    void operator = (const T* o) { target.store(o->getHandle(), std::memory_order_release); }
+    void operator = (const RootPtr<T>& o) { *this = o.get(); }
+    void operator = (const InstancePtr<T>& o) { *this = o.get(); }
+    void operator = (const WeakPtr<T>& o) { target.store(GC::weak_load(o.target), std::memory_order_release); }
+    void reset() { target.store(GC::NULLHandle, std::memory_order_release); }
+
+    T* get() const { return static_cast<T*>(GC::Handles[GC::weak_load(target)].ptr); }
+    RootPtr<T> lock() const { return RootPtr<T>(get()); }
+    bool expired() const { return GC::weak_load(target) == GC::NULLHandle; }
+
+    void clear_dying()
+    {
+        if (GC::weak_clear_if_dying(target) && queue != nullptr) queue->push(token);
+    }
+};
+
+/* A collectable with a flexible array of E right after it in the same block, made with GC::make_sized.
+*
+Derived is the class being made and E the element type, bytes or InstancePtrs.  The elements are constructed before
+Derived's constructor runs and destroyed after its destructor.  When E is an InstancePtr the whole array is traced, after
+any fixed instance variables Derived declares by hiding fixed_instance_vars and fixed_instance_var.  A class that only
+wants part of the array traced overrides total_instance_vars and index_into_instance_vars itself.
+Base is Collectable, or CollectableLeaf for an array of bytes.
+ */
+template <typename Derived, typename E, typename Base>
+class CollectableSizedTracing : public Base
+{
+    static InstancePtrBase* as_traced(InstancePtrBase* p) { return p; }
+    static InstancePtrBase* as_traced(void*) { return nullptr; }
+public:
+    static const bool traced = std::is_base_of<InstancePtrBase, E>::value;
+    int fixed_instance_vars() const { return 0; }
+    InstancePtrBase* fixed_instance_var(int num) { return nullptr; }
+    virtual int total_instance_vars() const
+    {
+        return static_cast<const Derived*>(this)->fixed_instance_vars() + (traced ? static_cast<const Derived*>(this)->trailing_size() : 0);
+    }
+    virtual InstancePtrBase* index_into_instance_vars(int num)
+    {
+        int f = static_cast<Derived*>(this)->fixed_instance_vars();
+        if (num < f) return static_cast<Derived*>(this)->fixed_instance_var(num);
+        return as_traced(static_cast<Derived*>(this)->trailing() + num - f);
+    }
+};
+//a leaf has nothing to trace
+template <typename Derived, typename E>
+class CollectableSizedTracing<Derived, E, CollectableLeaf> : public CollectableLeaf
+{
+    static_assert(!std::is_base_of<InstancePtrBase, E>::value, "a CollectableLeaf can't have traced elements");
+public:
+    static const bool traced = false;
+};
+
+template <typename Derived, typename E, typename Base = Collectable>
+class CollectableSized : public CollectableSizedTracing<Derived, E, Base>
+{
+    int trailing_count;
+    //only make_sized leaves room for the array
+    static void* operator new(size_t) = delete;
+protected:
+    explicit CollectableSized(int n) :trailing_count(n)
+    {
+        E* t = trailing();
+        for (int i = 0; i < n; ++i) new ((void*)(t + i)) E();
+        this->log_size(n * sizeof(E));
+    }
+    ~CollectableSized()
+    {
+        E* t = trailing();
+        for (int i = 0; i < trailing_count; ++i) t[i].~E();
+    }
+public:
+    static size_t trailing_offset() { return (sizeof(Derived) + alignof(E) - 1) / alignof(E) * alignof(E); }
+    static size_t bytes_for(int n) { return trailing_offset() + n * sizeof(E); }
+    E* trailing() { return (E*)((char*)static_cast<Derived*>(this) + trailing_offset()); }
+    const E* trailing() const { return (const E*)((const char*)static_cast<const Derived*>(this) + trailing_offset()); }
+    int trailing_size() const { return trailing_count; }
+
+    //the block came from ::operator new and is bigger than Derived
+    static void operator delete(void* p) { ::operator delete(p); }
+};
+
+namespace GC {
+    //allocates a T and n trailing elements as one block.  T's constructor takes n first and passes it on to CollectableSized
+    template <typename T, typename... A>
+    T* make_sized(int n, A&&... args)
+    {
+        void* p = ::operator new(T::bytes_for(n));
+        return ::new (p) T(n, std::forward<A>(args)...);
+    }
+}
+
+/* Collectables whose destructor does nothing.
+*
+A class derives from TriviallyFinalized<Derived, Base, Members...> instead of from Base to tell the finalizer that it can
+free the block without calling the destructor.  It's checked at compile time as far as it can be: Derived has to be
+final, so no subclass inherits the promise, Members are the types of the instance variables Derived adds and each has
+to be trivially destructible, and Base has to be Collectable, CollectableLeaf or a CollectableSized of those with
+trivially destructible elements.  The block has to come from plain new or GC::make_sized.
+*/
+namespace GC {
+    template <typename B> struct trivially_finalized_base : std::false_type {};
+    template <> struct trivially_finalized_base<Collectable> : std::true_type {};
+    template <> struct trivially_finalized_base<CollectableLeaf> : std::true_type {};
+    template <typename D, typename E, typename B> struct trivially_finalized_base<CollectableSized<D, E, B>>
+        : std::integral_constant<bool, std::is_trivially_destructible<E>::value && trivially_finalized_base<B>::value> {};
+
+    template <typename... T> struct all_trivially_destructible : std::true_type {};
+    template <typename T, typename... R> struct all_trivially_destructible<T, R...>
+        : std::integral_constant<bool, std::is_trivially_destructible<T>::value && all_trivially_destructible<R...>::value> {};
+}
+
+template <typename Derived, typename Base, typename... Members>
+class TriviallyFinalized : public Base
+{
+protected:
+    template <typename... A>
+    TriviallyFinalized(A&&... args) :Base(std::forward<A>(args)...)
+    {
+        static_assert(std::is_final<Derived>::value, "a TriviallyFinalized class has to be final");
+        static_assert(GC::trivially_finalized_base<Base>::value, "the base of a TriviallyFinalized class has a destructor to run");
+        static_assert(GC::all_trivially_destructible<Members...>::value, "a TriviallyFinalized class has a member with a destructor");
+        this->collectable_trivial_destructor = true;
+    }
+};
+
+//Keeps its length and, once it's asked for, its hash, so comparing two strings usually doesn't touch the bytes.
+//The bytes, with a 0 after them, are in the same block as the object, so make them with CollectableString::make.
+//Code that used to say new CollectableString(s) says CollectableString::make(s) now, or GC::intern(s) where the same
+//contents should give the same object.
+//Strings made by GC::intern() are the only ones with their contents, so two of them are equal only if they're the same object.
+struct CollectableString final : public TriviallyFinalized<CollectableString, CollectableSized<CollectableString, char, CollectableLeaf>, int, bool, std::atomic<uint64_t>>
+{
+    static const uint64_t HashSeed = 0xc243487c4b5ee78e;
+    int length;
+    //only set by GC::intern()
+    bool interned;
+    //0 until the first call to hash(), hash_bytes() never gives 0
+    mutable std::atomic<uint64_t> hash_cache;
+
+    static uint64_t hash_bytes(const char* s, int len)
+    {
+        uint64_t h = spooky_hash64((void*)s, len, HashSeed);
+        return h == 0 ? 1 : h;
+    }
+
+    //n is len + 1, from make_sized
+    CollectableString(int n, const char* s, int len) :TriviallyFinalized(n), length(len), interned(false), hash_cache(0)
+    {
+        memcpy(trailing(), s, len);
+        trailing()[len] = 0;
+        log_size(sizeof(*this));
+    }
+    static CollectableString* make(const char* s, int len) { return GC::make_sized<CollectableString>(len + 1, s, len); }
+    static CollectableString* make(const char* s) { return make(s, (int)strlen(s)); }
+    const char* str() const { return trailing(); }
     //virtual size_t my_size() const { return sizeof(*this); }
-    virtual InstancePtrBase* index_into_instance_vars(int num) { return nullptr; }
     virtual void clean_after_collect() {}
     virtual CollectableEqualityClass equality_class() const { return CollectableEqualityClass::by_string; }
     virtual bool equal(const Collectable* o)
     {
+        if (o == this) return true;
         CollectableEqualityClass oc = o->equality_class();
         if (equality_class() != oc) return false;
-        return strcmp(str,((CollectableString*)o)->str)==0;
+        const CollectableString* s = (const CollectableString*)o;
+        if (interned && s->interned) return false;
+        if (length != s->length) return false;
+        uint64_t h1 = hash_cache.load(std::memory_order_relaxed);
+        uint64_t h2 = s->hash_cache.load(std::memory_order_relaxed);
+        if (h1 != 0 && h2 != 0 && h1 != h2) return false;
+        return memcmp(str(), s->str(), length) == 0;
     }
     virtual uint64_t hash() const
     {
-
-        return spooky_hash64((void*)str,strlen(str), 0xc243487c4b5ee78e);
+        uint64_t h = hash_cache.load(std::memory_order_relaxed);
+        if (h == 0) {
+            h = hash_bytes(str(), length);
+            hash_cache.store(h, std::memory_order_relaxed);
+        }
+        return h;
     }
 
 };
@@ -595,7 +997,26 @@ struct std::hash<CollectableString>
 };
 
 inline std::ostream& operator<<(std::ostream& os, const RootPtr<CollectableString>& o) {
-    return os << o->str;
+    return os << o->str();
+}
+
+namespace GC {
+    //The one CollectableString with these bytes, made the first time they're asked for.  The table only holds the
+    //strings weakly, so once nothing else points at one the collector frees it and the next call makes a new one.
+    RootPtr<CollectableString> intern(const char* s, int len);
+    inline RootPtr<CollectableString> intern(const char* s) { return intern(s, (int)strlen(s)); }
+}
+
+//returns the block in slot, making it if it's null.  threads racing to make the same block agree on the one whose
+//compare and swap went in, the losers' blocks are just garbage
+template<typename B>
+B* insure_block_concurrent(InstancePtr<B>& slot)
+{
+    B* b = slot.load(std::memory_order_acquire);
+    if (b != collectable_null) return b;
+    B* n = new B;
+    if (slot.compare_exchange(b, n, std::memory_order_acq_rel)) return n;
+    return b;
 }
 
 template<typename T>
@@ -606,7 +1027,8 @@ struct CollectableBlock : public Collectable
     uint8_t reserved;
 
     //size_t my_size() { return sizeof(this); }
-    int total_instance_vars() { return reserved; }
+    //all of them, SharableVector::concurrent_push_back can fill any slot without touching reserved.  unused ones are null
+    int total_instance_vars() const { return 32; }
 
 
     InstancePtrBase* index_into_instance_vars(int num) { return &block[num]; }
@@ -662,7 +1084,7 @@ struct Collectable2Block : public Collectable
    
 
     //size_t my_size() { return sizeof(this); }
-    int total_instance_vars() { return b_reserved; }
+    int total_instance_vars() const { return 32; }
     InstancePtrBase* index_into_instance_vars(int num) { return &block[num]; }
     Collectable2Block() :size(0), b_reserved(0) { log_size(sizeof(this)); }
     bool push_back(const RootPtr<T>& o) {
@@ -744,7 +1166,7 @@ struct Collectable3Block : public Collectable
 
 
     //size_t my_size() { return sizeof(this); }
-    int total_instance_vars() { return b_reserved; }
+    int total_instance_vars() const { return 32; }
     Collectable3Block() :size(0), b_reserved(0) { log_size(sizeof(this)); }
     InstancePtrBase* index_into_instance_vars(int num) { return &block[num]; }
     bool push_back(const RootPtr<T>& o) {
@@ -825,7 +1247,7 @@ struct Collectable4Block : public Collectable
     int b_size(int i = 0) { return ((size + i - 1) >> 15)+1; }
 
     //size_t my_size() { return sizeof(this); }
-    int total_instance_vars() { return b_reserved; }
+    int total_instance_vars() const { return 32; }
     Collectable4Block() :size(0), b_reserved(0) { log_size(sizeof(this)); }
     InstancePtrBase* index_into_instance_vars(int num) { return &block[num]; }
     bool push_back(const RootPtr<T>& o) {
@@ -918,7 +1340,12 @@ template<typename T>
 struct CollectableInlineVector : public Collectable
 {
     T* data;
-    InstancePtrBase * * instance_counts;
+    //every element has the same layout, so the traced pointers are found from the element's index and the
+    //pointer's offset inside an element instead of from a table with an entry for each of them
+    int* field_offsets;
+    int vars_per_element;
+    //log2 of vars_per_element when that's a power of 2, otherwise -1
+    int vars_shift;
     int total_vars;
     int size;
     /*
@@ -948,21 +1375,23 @@ struct CollectableInlineVector : public Collectable
         return &data[i];
     }
 
-    CollectableInlineVector(int s) : instance_counts(nullptr),size(s){
+    CollectableInlineVector(int s) : field_offsets(nullptr), vars_per_element(0), vars_shift(-1), size(s){
         data = new T [s];
         assert(data != nullptr);
-        total_vars = 0;
-        for (int i = 0; i < s; ++i) {
-            total_vars += data[i].total_instance_vars();
+        if (s > 0) vars_per_element = data[0].total_instance_vars();
+        field_offsets = new int[vars_per_element];
+        for (int j = 0; j < vars_per_element; ++j) {
+            field_offsets[j] = (int)((char*)data[0].index_into_instance_vars(j) - (char*)&data[0]);
         }
-        instance_counts = new InstancePtrBase * [total_vars];
-        int t = 0;
-        for (int i = 0; i < s; ++i) {
-            for (int j = data[i].total_instance_vars() - 1; j >= 0; --j) {
-                instance_counts[t++] = data[i].index_into_instance_vars(j);
-            }
+#ifndef NDEBUG
+        for (int i = 1; i < s; ++i) {
+            assert(data[i].total_instance_vars() == vars_per_element);
+            for (int j = 0; j < vars_per_element; ++j) assert((char*)data[i].index_into_instance_vars(j) - (char*)&data[i] == field_offsets[j]);
         }
-        log_size( sizeof(*this) + size * sizeof(T) + total_vars * sizeof(void*));
+#endif
+        for (int b = 0; b < 31; ++b) if ((1 << b) == vars_per_element) vars_shift = b;
+        total_vars = s * vars_per_element;
+        log_size( sizeof(*this) + size * sizeof(T) + vars_per_element * sizeof(int));
     }
     int total_instance_vars() const
     {
@@ -970,16 +1399,25 @@ struct CollectableInlineVector : public Collectable
     }
 //    size_t my_size() const 
 //    {
-//        return sizeof(*this)+size*sizeof(T)+ total_vars*sizeof(void *);
+//        return sizeof(*this)+size*sizeof(T)+ vars_per_element*sizeof(int);
 //    }
     InstancePtrBase* index_into_instance_vars(int num)
     {
-        return instance_counts[num];
+        int e, f;
+        if (vars_shift >= 0) {
+            e = num >> vars_shift;
+            f = num & (vars_per_element - 1);
+        }
+        else {
+            e = num / vars_per_element;
+            f = num - e * vars_per_element;
+        }
+        return (InstancePtrBase*)((char*)&data[e] + field_offsets[f]);
     }
     ~CollectableInlineVector()
     {
         delete [] data;
-        delete[] instance_counts;
+        delete[] field_offsets;
     }
 };
 /*
@@ -1024,22 +1462,26 @@ public:
 };
 */
 template<typename T>
-struct CollectableVectoreUse : public Collectable
+struct CollectableVectoreUse : public CollectableSized<CollectableVectoreUse<T>, InstancePtr<T> >
 {
     int size;
     int scan_size;
     int reserved;
 
-    std::unique_ptr<InstancePtr<T> > data;
+#ifndef NDEBUG
+    using Collectable::memtest;
+#endif
+    //the elements are stored right after the object, made with GC::make_sized
+    InstancePtr<T>* items() { return this->trailing(); }
 
-    CollectableVectoreUse(int s) :size(0), scan_size(0), reserved(s), data(new InstancePtr<T>[s]) { log_size(sizeof(*this) + sizeof(InstancePtr<T>) * reserved); }
+    CollectableVectoreUse(int s) :CollectableSized<CollectableVectoreUse<T>, InstancePtr<T> >(s), size(0), scan_size(0), reserved(s) { this->log_size(sizeof(*this)); }
     int total_instance_vars() const {
         MEM_TEST();
         return scan_size;
     }
     InstancePtrBase* index_into_instance_vars(int num) {
         MEM_TEST();
-        return data.get() + num;
+        return items() + num;
     }
     //size_t my_size() const { return sizeof(*this) + sizeof(InstancePtr<T>) * reserved; }
 
@@ -1047,53 +1489,54 @@ struct CollectableVectoreUse : public Collectable
     bool push_back(const RootPtr<T>& o) {
         MEM_TEST();
         if (size >= reserved) return false;
-        (data.get())[size++] = o;
-        if (size > scan_size || GC::ThreadState != GC::PhaseEnum::COLLECTING) scan_size = size;
+        items()[size++] = o;
+        if (size > scan_size || GC::ThreadContext->phase != GC::PhaseEnum::COLLECTING) scan_size = size;
         return true;
     }
     bool pop_back(RootPtr<T>& o) {
         MEM_TEST();
         if (size == 0) return false;
-        o = (data.get())[--size].get();
-        (data.get())[size] = (T*)collectable_null;
-        assert(GC::ThreadState != GC::PhaseEnum::NOT_MUTATING);
-        if (scan_size > size && GC::ThreadState != GC::PhaseEnum::COLLECTING) scan_size = size;
+        o = items()[--size].get();
+        items()[size] = (T*)collectable_null;
+        assert(GC::ThreadContext->phase != GC::PhaseEnum::NOT_MUTATING);
+        if (scan_size > size && GC::ThreadContext->phase != GC::PhaseEnum::COLLECTING) scan_size = size;
         return true;
     }
     bool pop_back(InstancePtr<T>& o) {
         MEM_TEST();
         if (size == 0) return false;
-        o = (data.get())[--size];
-        (data.get())[size] = (T*)collectable_null;
-        assert(GC::ThreadState != GC::PhaseEnum::NOT_MUTATING);
-        if (scan_size > size && GC::ThreadState != GC::PhaseEnum::COLLECTING) scan_size = size;
+        o = items()[--size];
+        items()[size] = (T*)collectable_null;
+        assert(GC::ThreadContext->phase != GC::PhaseEnum::NOT_MUTATING);
+        if (scan_size > size && GC::ThreadContext->phase != GC::PhaseEnum::COLLECTING) scan_size = size;
         return true;
     }
     InstancePtr<T>& at (int i) {
         MEM_TEST();
         if (i < 0 || i >= size) throw std::out_of_range("CollectableVector index out of range");
-        return (data.get())[i];
+        return items()[i];
     }
     InstancePtr<T>& operator[](int i) {
         MEM_TEST();
-        return (data.get())[i];
+        return items()[i];
     }
     void clear()
     {
         MEM_TEST();
-        for (int i = 0; i < size; ++i) (data.get())[i] = (T*)collectable_null;
+        GC::fill_range(items(), (T*)collectable_null, size);
         size = 0;
-        assert(GC::ThreadState != GC::PhaseEnum::NOT_MUTATING);
-        if (GC::ThreadState != GC::PhaseEnum::COLLECTING) scan_size =0 ;
+        assert(GC::ThreadContext->phase != GC::PhaseEnum::NOT_MUTATING);
+        if (GC::ThreadContext->phase != GC::PhaseEnum::COLLECTING) scan_size =0 ;
     }
     bool resize(int s, const RootPtr<T>& exemplar)
     {
         MEM_TEST();
         if (s > reserved) return false;
-        if (s < size) while (size > s)(data.get())[--size] = (T*)collectable_null;
-        else while (size < s)(data.get())[size++] = exemplar;
-        assert(GC::ThreadState != GC::PhaseEnum::NOT_MUTATING);
-        if (size > scan_size || GC::ThreadState != GC::PhaseEnum::COLLECTING) scan_size = size;
+        if (s < size) GC::fill_range(items() + s, (T*)collectable_null, size - s);
+        else GC::fill_range(items() + size, exemplar.get(), s - size);
+        size = s;
+        assert(GC::ThreadContext->phase != GC::PhaseEnum::NOT_MUTATING);
+        if (size > scan_size || GC::ThreadContext->phase != GC::PhaseEnum::COLLECTING) scan_size = size;
 
         return true;
     }
@@ -1101,20 +1544,21 @@ struct CollectableVectoreUse : public Collectable
     {
         MEM_TEST();
         if (s > reserved) return false;
-        if (s < size) while (size > s)(data.get())[--size] = (T*)collectable_null;
-        else while (size < s)(data.get())[size++] = exemplar;
-        assert(GC::ThreadState != GC::PhaseEnum::NOT_MUTATING);
-        if (size > scan_size || GC::ThreadState != GC::PhaseEnum::COLLECTING) scan_size = size;
+        if (s < size) GC::fill_range(items() + s, (T*)collectable_null, size - s);
+        else GC::fill_range(items() + size, exemplar.get(), s - size);
+        size = s;
+        assert(GC::ThreadContext->phase != GC::PhaseEnum::NOT_MUTATING);
+        if (size > scan_size || GC::ThreadContext->phase != GC::PhaseEnum::COLLECTING) scan_size = size;
         return true;
     }
     bool resize(int s)
     {
         MEM_TEST();
         if (s > reserved) return false;
-        if (s < size) while (size > s)(data.get())[--size] = (T*)collectable_null;
+        if (s < size) GC::fill_range(items() + s, (T*)collectable_null, size - s);
         size = s;
-        assert(GC::ThreadState != GC::PhaseEnum::NOT_MUTATING);
-        if (size > scan_size || GC::ThreadState != GC::PhaseEnum::COLLECTING) scan_size = size;
+        assert(GC::ThreadContext->phase != GC::PhaseEnum::NOT_MUTATING);
+        if (size > scan_size || GC::ThreadContext->phase != GC::PhaseEnum::COLLECTING) scan_size = size;
         return true;
     }
     bool push_front(const RootPtr<T>& o)
@@ -1122,22 +1566,18 @@ struct CollectableVectoreUse : public Collectable
         MEM_TEST();
         if (size >= reserved) return false;
         if (size > 0) {
-            (*this)[size] = (*this)[size - 1];
-            for (int i = size - 1; i > 0; --i) {
-                if ((i & 1023) == 0) GC::safe_point();
-                (*this)[i] = (*this)[i - 1];
-            }
+            GC::move_range(items() + 1, items(), size);
             (*this)[0] = o;
             ++size;
         }
         else return push_back(o);
-        if (size > scan_size || GC::ThreadState != GC::PhaseEnum::COLLECTING) scan_size = size;
+        if (size > scan_size || GC::ThreadContext->phase != GC::PhaseEnum::COLLECTING) scan_size = size;
         return true;
     }
     void update_scan_size()
     {
-        assert(GC::ThreadState != GC::PhaseEnum::NOT_MUTATING);
-        if (size > scan_size || GC::ThreadState != GC::PhaseEnum::COLLECTING) scan_size = size;
+        assert(GC::ThreadContext->phase != GC::PhaseEnum::NOT_MUTATING);
+        if (size > scan_size || GC::ThreadContext->phase != GC::PhaseEnum::COLLECTING) scan_size = size;
     }
 };
 
@@ -1147,7 +1587,6 @@ class CollectableVector : public Collectable
 {
 
     friend class circular_double_list_iterator;
-    friend class const_iterator;
 
     InstancePtr<CollectableVectoreUse<T> > data;
     public:
@@ -1161,163 +1600,55 @@ class CollectableVector : public Collectable
     }
     //size_t my_size() const { return sizeof(*this); }
 
-    struct iterator;
-    struct const_iterator {
-        RootPtr<const CollectableVector<T> > v;
-        int pos;
+    //Random access iterators that hold a plain pointer to the vector and an index, so making or copying one allocates
+    //nothing.  They find the element through the vector each time, so they stay good across safe points and growth as
+    //long as the vector itself is rooted.  For the fastest loops and std::sort see raw_begin and raw_end.
+    template <typename V, typename R>
+    struct basic_iterator {
         using iterator_category = std::random_access_iterator_tag;
+        using value_type = InstancePtr<T>;
         using difference_type = int;
+        using pointer = R*;
+        using reference = R&;
 
-        explicit const_iterator() :pos(0) {  }
-        explicit const_iterator(RootPtr<CollectableVector<T> >& v) :pos(0) {  }
-
-        const_iterator(const CollectableVector<T>::const_iterator &t) :v(t.v), pos(t.pos) {}
-        const_iterator(const CollectableVector<T>::iterator &t) :v(t.v), pos(t.pos) {}
-
-        const_iterator& operator =(CollectableVector<T>::const_iterator t)
-        {
-            v = t.v;
-            pos = t.pos;
-            return *this;
-        }
-
-        const_iterator& operator =(CollectableVector<T>::iterator t)
-        {
-            v = t.v;
-            pos = t.pos;
-            return *this;
-        }
-
-        const_iterator& operator++() { ++pos; return *this; }
-        const_iterator& operator--() { --pos; return *this; }
-
-        const_iterator& operator+=(int i) { pos += i; return *this; }
-        const_iterator& operator-=(int i) { pos -= i; return *this; }
-
-        const_iterator operator+(int i) { return const_iterator(v, pos + i); }
-        const_iterator operator-(int i) { return const_iterator(v, pos - i); }
-
-        RootPtr<T> operator++(int) { int p = pos;  ++pos; return v[p]; }
-        RootPtr<T> operator--(int) { int p = pos;  --pos; return v[p]; }
-
-        RootPtr<T> operator*() { return v[pos]; }
-        const InstancePtr<T>* operator->() { return &v[pos]; }
-
-        bool operator == (CollectableVector<T>::iterator i) {
-            return pos == i.pos && v.data.get() == i.pos.data.get();
-        }
-        bool operator < (CollectableVector<T>::iterator i) {
-            return pos < i.pos&& v.data.get() == i.pos.data.get();
-        }
-        bool operator > (CollectableVector<T>::iterator i) {
-            return pos > i.pos && v.data.get() == i.pos.data.get();
-        }
-        bool operator >= (CollectableVector<T>::iterator i) {
-            return pos >= i.pos && v.data.get() == i.pos.data.get();
-        }
-        bool operator <= (CollectableVector<T>::iterator i) {
-            return pos <= i.pos && v.data.get() == i.pos.data.get();
-        }
-        bool operator != (CollectableVector<T>::iterator i) {
-            return pos != i.pos && v.data.get() == i.pos.data.get();
-        }
-        bool operator == (CollectableVector<T>::const_iterator i) {
-            return pos == i.pos && v.data.get() == i.pos.data.get();
-        }
-        bool operator < (CollectableVector<T>::const_iterator i) {
-            return pos < i.pos&& v.data.get() == i.pos.data.get();
-        }
-        bool operator > (CollectableVector<T>::const_iterator i) {
-            return pos > i.pos && v.data.get() == i.pos.data.get();
-        }
-        bool operator >= (CollectableVector<T>::const_iterator i) {
-            return pos >= i.pos && v.data.get() == i.pos.data.get();
-        }
-        bool operator <= (CollectableVector<T>::const_iterator i) {
-            return pos <= i.pos && v.data.get() == i.pos.data.get();
-        }
-        bool operator != (CollectableVector<T>::const_iterator i) {
-            return pos != i.pos && v.data.get() == i.pos.data.get();
-        }
-    };
-    struct iterator{
-        using iterator_category = std::random_access_iterator_tag;
-        using difference_type = int;
-
-        RootPtr<CollectableVector<T> > v;
+        V* v;
         int pos;
-        explicit iterator():pos(0) {  }
-        explicit iterator(const RootPtr<CollectableVector<T> > &v) :v(v),pos(0) {  }
-        explicit iterator(const RootPtr<CollectableVector<T> >& v, int p) :v(v),pos(p) {  }
-        iterator(const CollectableVector<T>::const_iterator &t) :v(t.v), pos(t.pos) {}
-        iterator(const CollectableVector<T>::iterator &t) :v(t.v), pos(t.pos) {}
-        
-        iterator& operator =(CollectableVector<T>::const_iterator t)
-        {
-            v = t.v;
-            pos = t.pos;
-            return *this;
-        }
-
-        iterator& operator =(CollectableVector<T>::iterator t)
-        {
-            v = t.v;
-            pos = t.pos;
-            return *this;
-        }
-
-        iterator& operator++() { ++pos; return *this; }
-        iterator& operator--() { --pos; return *this; }
-
-        iterator& operator+=(int i) { pos+=i; return *this; }
-        iterator& operator-=(int i) { pos-=i; return *this; }
-
-        iterator operator+(int i) { return iterator(v, pos + i); }
-        iterator operator-(int i) { return iterator(v, pos - i); }
-
-        RootPtr<T> operator++(int) { int p = pos;  ++pos; return v[p]; }
-        RootPtr<T> operator--(int) { int p = pos;  --pos; return v[p]; }
+        basic_iterator() :v(nullptr), pos(0) {}
+        basic_iterator(V* v, int p = 0) :v(v), pos(p) {}
+        //an iterator converts to a const_iterator, for the non const one this is just the copy constructor
+        basic_iterator(const basic_iterator<CollectableVector<T>, InstancePtr<T> >& t) :v(t.v), pos(t.pos) {}
+
+        basic_iterator& operator++() { ++pos; return *this; }
+        basic_iterator& operator--() { --pos; return *this; }
+        basic_iterator operator++(int) { basic_iterator t = *this; ++pos; return t; }
+        basic_iterator operator--(int) { basic_iterator t = *this; --pos; return t; }
+
+        basic_iterator& operator+=(int i) { pos += i; return *this; }
+        basic_iterator& operator-=(int i) { pos -= i; return *this; }
+        basic_iterator operator+(int i) const { return basic_iterator(v, pos + i); }
+        basic_iterator operator-(int i) const { return basic_iterator(v, pos - i); }
+        friend basic_iterator operator+(int i, const basic_iterator& t) { return basic_iterator(t.v, t.pos + i); }
+        int operator-(const basic_iterator& i) const { return pos - i.pos; }
+
+        R& operator*() const { return v->data->items()[pos]; }
+        R* operator->() const { return &v->data->items()[pos]; }
+        R& operator[](int i) const { return v->data->items()[pos + i]; }
+
+        bool operator == (const basic_iterator& i) const { return pos == i.pos; }
+        bool operator != (const basic_iterator& i) const { return pos != i.pos; }
+        bool operator < (const basic_iterator& i) const { return pos < i.pos; }
+        bool operator > (const basic_iterator& i) const { return pos > i.pos; }
+        bool operator <= (const basic_iterator& i) const { return pos <= i.pos; }
+        bool operator >= (const basic_iterator& i) const { return pos >= i.pos; }
+    };
+    typedef basic_iterator<CollectableVector<T>, InstancePtr<T> > iterator;
+    typedef basic_iterator<const CollectableVector<T>, const InstancePtr<T> > const_iterator;
 
-        InstancePtr<T>& operator*() { return v->operator[](pos); }
-        InstancePtr<T>* operator->() { return &v[pos]; }
+    //The storage itself, for running std algorithms over plain pointers.  Like a raw pointer to a collectable these
+    //are only good until the next safe point, and anything that grows the vector invalidates them.
+    InstancePtr<T>* raw_begin() { return data->items(); }
+    InstancePtr<T>* raw_end() { return data->items() + size(); }
 
-        bool operator == (CollectableVector<T>::iterator i) {
-            return pos == i.pos && v->data.get() == i.v->data.get();
-        }
-        bool operator < (CollectableVector<T>::iterator i) {
-            return pos < i.pos && v->data.get() == i.v->data.get();
-        }
-        bool operator > (CollectableVector<T>::iterator i) {
-            return pos > i.pos && v->data.get() == i.v->data.get();
-        }
-        bool operator >= (CollectableVector<T>::iterator i) {
-            return pos >= i.pos && v->data.get() == i.v->data.get();
-        }
-        bool operator <= (CollectableVector<T>::iterator i) {
-            return pos <= i.pos && v->data.get() == i.v->data.get();
-        }
-        bool operator != (CollectableVector<T>::iterator i) {
-            return pos != i.pos && v->data.get() == i.v->data.get();
-        }
-        bool operator == (CollectableVector<T>::const_iterator i) {
-            return pos == i.pos && v->data.get() == i.v->data.get();
-        }
-        bool operator < (CollectableVector<T>::const_iterator i) {
-            return pos < i.pos&& v->data.get() == i.v->data.get();
-        }
-        bool operator > (CollectableVector<T>::const_iterator i) {
-            return pos > i.pos && v->data.get() == i.v->data.get();
-        }
-        bool operator >= (CollectableVector<T>::const_iterator i) {
-            return pos >= i.pos && v->data.get() == i.v->data.get();
-        }
-        bool operator <= (CollectableVector<T>::const_iterator i) {
-            return pos <= i.pos && v->data.get() == i.v->data.get();
-        }
-        bool operator != (CollectableVector<T>::const_iterator i) {
-            return pos != i.pos && v->data.get() == i.v->data.get();
-        }
-    };
     iterator begin() {
         MEM_TEST();
         return iterator(this);
@@ -1362,11 +1693,11 @@ class CollectableVector : public Collectable
         for (int i = 0; i < s; ++i) push_back(o->at(i));
     }
 
-    CollectableVector() : data(new CollectableVectoreUse<T>(8)) { log_size(sizeof(*this)); }
-    CollectableVector(int s) : data(new  CollectableVectoreUse<T>(s<<1)){ log_size(sizeof(*this)); }
-    CollectableVector(int s, const RootPtr<T>& exemplar) : data(new  CollectableVectoreUse<T>(s << 1)){ resize(s, exemplar); log_size(sizeof(*this));
+    CollectableVector() : data(GC::make_sized<CollectableVectoreUse<T> >(8)) { log_size(sizeof(*this)); }
+    CollectableVector(int s) : data(GC::make_sized<CollectableVectoreUse<T> >(s<<1)){ log_size(sizeof(*this)); }
+    CollectableVector(int s, const RootPtr<T>& exemplar) : data(GC::make_sized<CollectableVectoreUse<T> >(s << 1)){ resize(s, exemplar); log_size(sizeof(*this));
     }
-    CollectableVector(int s, InstancePtr<T>& exemplar) : data(new  CollectableVectoreUse<T>(s << 1)) { resize(s, exemplar); log_size(sizeof(*this));
+    CollectableVector(int s, InstancePtr<T>& exemplar) : data(GC::make_sized<CollectableVectoreUse<T> >(s << 1)) { resize(s, exemplar); log_size(sizeof(*this));
     }
     void push_back(const RootPtr<T>& o)
     {
@@ -1394,12 +1725,12 @@ class CollectableVector : public Collectable
     RootPtr<T> operator[](int i) const
     {
         MEM_TEST();
-        return data->data.get()[i];
+        return data->items()[i];
     }
     InstancePtr<T>& operator[](int i)
     {
         MEM_TEST();
-        return data->data.get()[i];
+        return data->items()[i];
     }
     RootPtr<T> at(int i) const
     {
@@ -1419,39 +1750,33 @@ class CollectableVector : public Collectable
 
     iterator erase(const_iterator t) {
         MEM_TEST();
-        if (t.pos >= size) return end();
+        if (t.pos >= size()) return end();
         int s = size() - 1;
-        for (int i=t.pos;i<s;++i)
-        {
-            data->data.get()[i] = data->data.get()[i + 1];
-        }
-        data->data.get()[s] = collectable_null;
+        InstancePtr<T>* d = data->items();
+        GC::move_range(d + t.pos, d + t.pos + 1, s - t.pos);
+        d[s] = (T*)collectable_null;
         data->size = s;
         data->update_scan_size();
-        return iterator(*this,t.pos+1);
+        return iterator(this, t.pos);
     }
 
     iterator erase(const_iterator f, const_iterator t) {
         MEM_TEST();
-        if (f.pos >= size) return end();
-        if (f.pos >= t.pos) return iterator(*this, f.pos);
+        if (f.pos >= size()) return end();
+        if (f.pos >= t.pos) return iterator(this, f.pos);
 
         int e = t.pos;
         if (e > size())e = size();
         int d = e - f.pos;
         int s = size() - d;
-        int i;
-        for (i = f.pos; i < s; ++i)
-        {
-            data->data.get()[i] = data->data.get()[i + d];
-        }
-        for (;i<size();++i)
-            data->data.get()[i] = collectable_null;
+        InstancePtr<T>* p = data->items();
+        GC::move_range(p + f.pos, p + e, size() - e);
+        GC::fill_range(p + s, (T*)collectable_null, d);
 
         data->size = s;
         data->update_scan_size();
 
-        return iterator(*this, f.pos + 1);
+        return iterator(this, f.pos);
     }
 
     iterator insert(const_iterator f, const RootPtr<T>& a)
@@ -1462,8 +1787,8 @@ class CollectableVector : public Collectable
         if (p > s) p = s;
         if (p < 0)p = 0;
         reserve(s + 1);
-        for (int i = s; i > p; --i)data->data.get()[i] = data->data.get()[i - 1];
-        data->data.get()[p] = a;
+        GC::move_range(data->items() + p + 1, data->items() + p, s - p);
+        data->items()[p] = a;
         ++data->size;
         data->update_scan_size();
 
@@ -1474,14 +1799,15 @@ class CollectableVector : public Collectable
     {
         MEM_TEST();
         int p = f.pos;
-        if (n<1) return iterator(*this, p);
+        if (n<1) return iterator(this, p);
         int s = size();
         if (p > s) p = s;
         if (p < 0)p = 0;
         reserve(s + n);
-        for (int i = s-1; i >= p; --i)data->data.get()[i+n] = data->data.get()[i];
-        for (int i=0;i<n;++i) data->data.get()[p+i] = a;
+        GC::move_range(data->items() + p + n, data->items() + p, s - p);
+        GC::fill_range(data->items() + p, a.get(), n);
         data->size+=n;
+        data->update_scan_size();
         return iterator(this, p+n);
     }
     iterator insert(const_iterator f, const_iterator t, const RootPtr<T>& a)
@@ -1489,14 +1815,14 @@ class CollectableVector : public Collectable
         MEM_TEST();
         int n = t.pos - f.pos;
         int p = f.pos;
-        if (n < 1) return iterator(*this, p);
+        if (n < 1) return iterator(this, p);
         int s = size();
         if (p > s) p = s;
         if (p < 0)p = 0;
         reserve(s + n);
-        for (int i = s - 1; i >= p; --i)data->data.get()[i + n] = data->data.get()[i];
+        GC::move_range(data->items() + p + n, data->items() + p, s - p);
         for (int i = 0; i < n; ++i) {
-            data->data.get()[p + i] = *f;
+            data->items()[p + i] = *f;
             ++f;
         }
         data->size += n;
@@ -1516,19 +1842,13 @@ class CollectableVector : public Collectable
         MEM_TEST();
         if (!data->resize(s, exemplar)) {
             RootPtr<CollectableVectoreUse<T> > data_held_for_collect = data;
-            data = new CollectableVectoreUse<T>(this, s << 1);
-            InstancePtr<T>* source = data_held_for_collect.data.get();
-            InstancePtr<T>* dest = data.data.get();
-
-            int i;
-            for (i = 0; i < data_held_for_collect->size; ++i) {
-                if ((i & 1023) == 0) GC::safe_point();
-                dest[i] = source[i];
-            }
-            for (; i < data->size; ++i) {
-                if ((i & 1023) == 0) GC::safe_point();
-                dest[i] = exemplar;
-            }
+            data = GC::make_sized<CollectableVectoreUse<T> >(s << 1);
+            InstancePtr<T>* source = data_held_for_collect->items();
+            InstancePtr<T>* dest = data->items();
+            int old_size = data_held_for_collect->size;
+
+            GC::copy_range(dest, source, old_size);
+            GC::fill_range(dest + old_size, exemplar.get(), s - old_size);
             data->size = s;
             data->update_scan_size();
 
@@ -1539,19 +1859,13 @@ class CollectableVector : public Collectable
         MEM_TEST();
         if (!data->resize(s,exemplar)) {
             RootPtr<CollectableVectoreUse<T> > data_held_for_collect = data;
-            data = new CollectableVectoreUse<T>(this, s << 1);
-            InstancePtr<T>* source = data_held_for_collect.data.get();
-            InstancePtr<T>* dest = data.data.get();
-
-            int i;
-            for (i = 0; i < data_held_for_collect->size; ++i) { 
-                if ((i & 1023) == 0) GC::safe_point();
-                dest[i] = source[i];
-            }
-            for (; i < data->size; ++i) {
-                if ((i & 1023) == 0) GC::safe_point();
-                dest[i] = exemplar;
-            }
+            data = GC::make_sized<CollectableVectoreUse<T> >(s << 1);
+            InstancePtr<T>* source = data_held_for_collect->items();
+            InstancePtr<T>* dest = data->items();
+            int old_size = data_held_for_collect->size;
+
+            GC::copy_range(dest, source, old_size);
+            GC::fill_range(dest + old_size, exemplar.get(), s - old_size);
             data->size = s;
             data->update_scan_size();
 
@@ -1560,9 +1874,7 @@ class CollectableVector : public Collectable
     void resize(int s) {
         MEM_TEST();
         reserve(s);
-        data->size = s;
-        data->update_scan_size();
-
+        data->resize(s);
     }
     //sets the reservation to at least s, not the size
     void reserve(int s)
@@ -1570,14 +1882,11 @@ class CollectableVector : public Collectable
         MEM_TEST();
         if (data->reserved < s) {
             RootPtr<CollectableVectoreUse<T> > data_held_for_collect ( data);
-            data = new CollectableVectoreUse<T>( s << 1);
-            InstancePtr<T> * source = data_held_for_collect->data.get();
-            InstancePtr<T> * dest = data->data.get();
+            data = GC::make_sized<CollectableVectoreUse<T> >( s << 1);
+            InstancePtr<T> * source = data_held_for_collect->items();
+            InstancePtr<T> * dest = data->items();
 
-            for (int i = data_held_for_collect->size - 1; i >= 0; --i) { 
-                if ((i & 1023) == 0) GC::safe_point();
-                dest[i] = source[i];
-            }
+            GC::copy_range(dest, source, data_held_for_collect->size);
             data->size = data_held_for_collect->size;
             data->update_scan_size();
 
@@ -1589,15 +1898,11 @@ class CollectableVector : public Collectable
  //       reserve(s);
         if (!data->push_front(o)) {
             RootPtr<CollectableVectoreUse<T> > data_held_for_collect ( data);
-            data = new  CollectableVectoreUse<T>(s << 1);
-            InstancePtr<T>* source = data_held_for_collect->data.get();
-            InstancePtr<T>* dest = data->data.get();
-
-            int i;
-            for (i = s-2; i >= 0; --i) {
-                if ((i & 1023) == 0) GC::safe_point();
-                dest[i+1] = source[i];
-            }
+            data = GC::make_sized<CollectableVectoreUse<T> >(s << 1);
+            InstancePtr<T>* source = data_held_for_collect->items();
+            InstancePtr<T>* dest = data->items();
+
+            GC::copy_range(dest + 1, source, s - 1);
             dest[0] = o;
             data->size = s;
             data->update_scan_size();
@@ -1627,10 +1932,20 @@ class CollectableVector : public Collectable
 
 };
 
+/* SharableVector never moves an element once it's in, so it can also be used as a concurrent append only log.
+*
+concurrent_push_back takes the next index with one fetch_add, makes any missing blocks on the way down with a compare and
+swap and publishes the element with a release store, so any number of threads can append with no lock.  concurrent_get
+follows the same path with acquire loads and gives null for an index whose push hasn't finished yet.
+
+A vector used this way should only be used through the concurrent_ functions, they don't keep the blocks' sizes.
+ */
 template<typename T>
-class SharableVector : Collectable
+class SharableVector : public Collectable
 {
     InstancePtr< Collectable4Block<T> > blocks;
+    //indexes handed out by concurrent_push_back, some may not be published yet
+    std::atomic_int claimed;
 public:
     int total_instance_vars() const {
         return 1;
@@ -1641,7 +1956,7 @@ public:
     //size_t my_size() const { return sizeof(*this); }
 
 
-    SharableVector() :blocks(new Collectable4Block<T>) { log_size(sizeof(*this)); }
+    SharableVector() :blocks(new Collectable4Block<T>), claimed(0) { log_size(sizeof(*this)); }
     bool push_back(const RootPtr<T>& o) 
     {
         return blocks->push_back(o);
@@ -1684,6 +1999,93 @@ public:
         return at(size()-1);
     }
 
+    //A random access cursor over the block trie.  It keeps a pointer to the block of 32 it's in, so stepping through the
+    //vector only walks down the trie once a block.  Blocks stay in the trie once they're made, so a cursor is good for
+    //as long as the vector is rooted, but it allocates nothing and holds no root of its own.
+    struct iterator {
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = InstancePtr<T>;
+        using difference_type = int;
+        using pointer = InstancePtr<T>*;
+        using reference = InstancePtr<T>&;
+
+        SharableVector<T>* v;
+        int pos;
+        //first slot of the block holding element base
+        mutable InstancePtr<T>* chunk;
+        mutable int base;
+
+        iterator() :v(nullptr), pos(0), chunk(nullptr), base(0) {}
+        iterator(SharableVector<T>* v, int p) :v(v), pos(p), chunk(nullptr), base(0) {}
+
+        InstancePtr<T>& element(int i) const
+        {
+            if (chunk == nullptr || (unsigned)(i - base) >= 32) {
+                base = i & ~31;
+                chunk = &(*v->blocks.get())[base];
+            }
+            return chunk[i - base];
+        }
+
+        iterator& operator++() { ++pos; return *this; }
+        iterator& operator--() { --pos; return *this; }
+        iterator operator++(int) { iterator t = *this; ++pos; return t; }
+        iterator operator--(int) { iterator t = *this; --pos; return t; }
+
+        iterator& operator+=(int i) { pos += i; return *this; }
+        iterator& operator-=(int i) { pos -= i; return *this; }
+        iterator operator+(int i) const { iterator t = *this; t.pos += i; return t; }
+        iterator operator-(int i) const { iterator t = *this; t.pos -= i; return t; }
+        friend iterator operator+(int i, const iterator& t) { return t + i; }
+        int operator-(const iterator& i) const { return pos - i.pos; }
+
+        InstancePtr<T>& operator*() const { return element(pos); }
+        InstancePtr<T>* operator->() const { return &element(pos); }
+        InstancePtr<T>& operator[](int i) const { return element(pos + i); }
+
+        bool operator == (const iterator& i) const { return pos == i.pos; }
+        bool operator != (const iterator& i) const { return pos != i.pos; }
+        bool operator < (const iterator& i) const { return pos < i.pos; }
+        bool operator > (const iterator& i) const { return pos > i.pos; }
+        bool operator <= (const iterator& i) const { return pos <= i.pos; }
+        bool operator >= (const iterator& i) const { return pos >= i.pos; }
+    };
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, size()); }
+
+    //returns the element's index, or -1 when the vector is full
+    int concurrent_push_back(const RootPtr<T>& o)
+    {
+        assert(o.get() != collectable_null);
+        int i = claimed.fetch_add(1, std::memory_order_relaxed);
+        if (i >= 32 * 32 * 32 * 32) {
+            claimed.fetch_sub(1, std::memory_order_relaxed);
+            return -1;
+        }
+        Collectable3Block<T>* b3 = insure_block_concurrent(blocks->block[i >> 15]);
+        Collectable2Block<T>* b2 = insure_block_concurrent(b3->block[31 & (i >> 10)]);
+        CollectableBlock<T>* b1 = insure_block_concurrent(b2->block[31 & (i >> 5)]);
+        b1->block[i & 31].store(o.get(), std::memory_order_release);
+        return i;
+    }
+    //null if i hasn't been claimed or its push is still going on
+    RootPtr<T> concurrent_get(int i)
+    {
+        if (i < 0 || i >= concurrent_size()) return (T*)collectable_null;
+        Collectable3Block<T>* b3 = blocks->block[i >> 15].load(std::memory_order_acquire);
+        if (b3 == collectable_null) return (T*)collectable_null;
+        Collectable2Block<T>* b2 = b3->block[31 & (i >> 10)].load(std::memory_order_acquire);
+        if (b2 == collectable_null) return (T*)collectable_null;
+        CollectableBlock<T>* b1 = b2->block[31 & (i >> 5)].load(std::memory_order_acquire);
+        if (b1 == collectable_null) return (T*)collectable_null;
+        return b1->block[i & 31].load(std::memory_order_acquire);
+    }
+    //how many indexes have been handed out, the last few can still be unpublished
+    int concurrent_size() const
+    {
+        int c = claimed.load(std::memory_order_acquire);
+        return c < 32 * 32 * 32 * 32 ? c : 32 * 32 * 32 * 32;
+    }
 };
 
 class CollectableSentinel : public Collectable
@@ -1,15 +1,34 @@
 #pragma once
 #include "Collectable.h"
 #include "spooky.h"
+#include <memory>
+#include <string.h>
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SWISS_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 
 /* A simple hash table with the following assumptions:
-* 
+*
 1) the keys are any collectable type.  I added a hash function to collectables that defaults to being based on the address.  But I also added a string type.  All hashing is based on spookyhash.
 2) the value type should be a collectable or at least something that has the total_instance_vars() and index_into_instance_vars(int) methods.  They will all be stored in a single block and the whole thing collected at once.
 3) The table length has to be a power of 2 and will grow as necessary to mostly avoid collisions
 
-The hash table uses linear probing and stays at least 4 times as big as the number of elements.  You can delete from this hash table, it handles that by marking elements "deleted" and not moving anything.
+All of the tables share one open addressing engine (SwissHash::Table below, over the tags in SwissHash::Control).  Next to the entries there is an array of one byte
+control tags, one per slot: empty, deleted, or 7 bits of the hash of the key in the slot.  A probe loads 16 tags at once and compares
+them all against the key's 7 bits, so it only looks at entries that are almost certainly the key.  Every entry also stores its
+32 bit hash, which is compared before the keys are and which is reused when the table grows, so a key's hash() is computed once
+per operation instead of once per probed entry.  The tables fill up to 7/8 before they grow.
+
+You can delete from these hash tables, that marks the slot deleted and doesn't move anything.
+
+Growing doesn't happen all at once.  The old entries and control tags are kept next to the new ones and every operation moves
+the next HASH_MIGRATE_SLOTS slots across, lookups check both until it's done.  So inserting into a table with millions of keys
+never stops to copy all of them.  Undefine INCREMENTAL_REHASH to move everything as soon as the table grows.
 
  */
 
@@ -21,591 +40,985 @@ inline int nearest_power_of_2(int i)
 }
 
 #define INITIAL_HASH_SIZE 1024
+#define INCREMENTAL_REHASH
+#define HASH_MIGRATE_SLOTS 64
+#define HASH_BATCH 16
 
 extern CollectableSentinel CollectableNull;
 
+namespace SwissHash {
+	const int8_t Empty = -128;
+	const int8_t Deleted = -2;
+	const int GroupWidth = 16;
 
-template<typename K, typename V>
-struct CollectableKeyHashEntry
-{
-	bool skip;
-	bool empty;
-	InstancePtr<K> key;
+	//the tables hash with spooky or std::hash, and std::hash is often the identity, so spread the bits before using them
+	inline uint32_t mix(uint64_t h)
+	{
+		h *= 0x9E3779B97F4A7C15ull;
+		return (uint32_t)(h >> 32);
+	}
+	inline int8_t h2(uint32_t hash) { return (int8_t)(hash & 0x7f); }
+	inline uint32_t h1(uint32_t hash) { return hash >> 7; }
 
-	alignas(alignof(V)) uint8_t value_bytes[sizeof(V)];
-	V& value() { return *(V*)&value_bytes[0]; }
-	const V& value() const { return *(V*)&value_bytes[0]; }
-	CollectableKeyHashEntry() :skip(false), empty(true), key(static_cast<K *>(collectable_null)) {}
-	int total_instance_vars() const { return 1; }
-	InstancePtrBase* index_into_instance_vars(int num) { return &key;  }
-	~CollectableKeyHashEntry() { if (!empty) value().~V(); }
-};
+	inline void prefetch(const void* p)
+	{
+#ifdef SWISS_SSE2
+		_mm_prefetch((const char*)p, _MM_HINT_T0);
+#elif defined(__GNUC__)
+		__builtin_prefetch(p);
+#endif
+	}
 
-template<typename K, typename V>
-struct CollectableKeyHashTable :public Collectable
-{
-	int HASH_SIZE;
-	int used;
-	mutable int wasted;
-	InstancePtr<CollectableInlineVector<struct CollectableKeyHashEntry<K, V>>> data;
-	V empty_v;
+	inline int lowest_bit(uint32_t m)
+	{
+#ifdef _MSC_VER
+		unsigned long i;
+		_BitScanForward(&i, m);
+		return (int)i;
+#else
+		return __builtin_ctz(m);
+#endif
+	}
 
-	CollectableKeyHashTable(const V& ev,int s = INITIAL_HASH_SIZE) :HASH_SIZE(nearest_power_of_2(s)), used(0), wasted(0), data(new CollectableInlineVector<CollectableKeyHashEntry<K, V>>(HASH_SIZE)),empty_v(ev) {}
+	//bit n of the result is set if the nth tag of the group starting at ctrl equals tag
+	inline uint32_t match(const int8_t* ctrl, int8_t tag)
+	{
+#ifdef SWISS_SSE2
+		return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl))));
+#else
+		uint32_t m = 0;
+		for (int i = 0; i < GroupWidth; ++i) if (ctrl[i] == tag) m |= 1u << i;
+		return m;
+#endif
+	}
+	inline uint32_t match_empty(const int8_t* ctrl) { return match(ctrl, Empty); }
+	//empty and deleted are the only tags with the sign bit set
+	inline uint32_t match_free(const int8_t* ctrl)
+	{
+#ifdef SWISS_SSE2
+		return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl)));
+#else
+		uint32_t m = 0;
+		for (int i = 0; i < GroupWidth; ++i) if (ctrl[i] < 0) m |= 1u << i;
+		return m;
+#endif
+	}
 
-	void inc_used()
+	//The control tags for a table of capacity slots.  The first GroupWidth-1 tags are repeated after the end so that a group
+	//can be loaded starting at any slot without wrapping.  growth_left counts the empty slots that can still be used before
+	//the table is 7/8 full, deleted slots don't give it back, so there are always empty slots for a probe to stop at.
+	struct Control
 	{
-		++used;
-		if (((used + wasted) << 2) > HASH_SIZE)
+		int capacity;
+		int growth_left;
+		std::unique_ptr<int8_t[]> ctrl;
+
+		Control(int cap = 0) :capacity(cap), growth_left(cap - (cap >> 3)), ctrl(new int8_t[cap + GroupWidth - 1])
 		{
-			int OLD_HASH_SIZE = HASH_SIZE;
-			HASH_SIZE <<= 1;
-			RootPtr<CollectableInlineVector<CollectableKeyHashEntry<K, V> > > t = data;
-			data = new CollectableInlineVector<CollectableKeyHashEntry<K, V> >(HASH_SIZE);
-			used = 0;
-			wasted = 0;
-			for (int i = 0; i < OLD_HASH_SIZE; ++i) {
-				GC::safe_point();
-				if (!t[i]->empty) insert(t[i]->key, t[i]->value());
+			memset(ctrl.get(), Empty, cap + GroupWidth - 1);
+		}
+		bool full(int i) const { return ctrl[i] >= 0; }
+		void set(int i, int8_t tag)
+		{
+			ctrl[i] = tag;
+			if (i < GroupWidth - 1) ctrl[capacity + i] = tag;
+		}
+
+		//calls found(slot) for every slot whose tag matches hash until it returns true and gives that slot, or -1 if there isn't one
+		template <typename F>
+		int find(uint32_t hash, F&& found) const
+		{
+			int mask = capacity - 1;
+			int pos = h1(hash) & mask;
+			int8_t tag = h2(hash);
+			for (int step = GroupWidth;; step += GroupWidth) {
+				const int8_t* g = ctrl.get() + pos;
+				for (uint32_t m = match(g, tag); m != 0; m &= m - 1) {
+					int i = (pos + lowest_bit(m)) & mask;
+					if (found(i)) return i;
+				}
+				if (match_empty(g) != 0) return -1;
+				pos = (pos + step) & mask;
+			}
+		}
+		//prefetches the first group of tags for hash and returns the slot the probe starts at
+		int prefetch(uint32_t hash) const
+		{
+			int pos = h1(hash) & (capacity - 1);
+			SwissHash::prefetch(ctrl.get() + pos);
+			return pos;
+		}
+		//the first empty or deleted slot on hash's probe sequence
+		int find_free(uint32_t hash) const
+		{
+			int mask = capacity - 1;
+			int pos = h1(hash) & mask;
+			for (int step = GroupWidth;; step += GroupWidth) {
+				uint32_t m = match_free(ctrl.get() + pos);
+				if (m != 0) return (pos + lowest_bit(m)) & mask;
+				pos = (pos + step) & mask;
 			}
 		}
+		//returns true if the slot had been deleted rather than empty
+		bool claim(int i, uint32_t hash)
+		{
+			bool reused = ctrl[i] == Deleted;
+			if (!reused) --growth_left;
+			set(i, h2(hash));
+			return reused;
+		}
+		void erase(int i) { set(i, Deleted); }
+		void clear()
+		{
+			memset(ctrl.get(), Empty, capacity + GroupWidth - 1);
+			growth_left = capacity - (capacity >> 3);
+		}
+		//when growth_left runs out, double if more than half of the usable slots are live, otherwise only the deleted slots need clearing out
+		int next_capacity(int used) const
+		{
+			return (used << 1) > capacity - (capacity >> 3) ? capacity << 1 : capacity;
+		}
+	};
+
+	//the entries of a table that's collectable live in a collectable block, a leaf table keeps them in a std::vector
+	template<typename E>
+	using CollectableEntries = InstancePtr<CollectableInlineVector<E>>;
+
+	template<typename E>
+	E* entries(const CollectableEntries<E>& d) { return (*d)[0]; }
+	template<typename E>
+	E* entries(const std::vector<E>& d) { return const_cast<E*>(d.data()); }
+	//d is empty beforehand
+	template<typename E>
+	void allocate(CollectableEntries<E>& d, int n) { d = new CollectableInlineVector<E>(n); }
+	template<typename E>
+	void allocate(std::vector<E>& d, int n) { d.resize(n); }
+	//moves the current entries to old and gives current n empty ones, old is empty beforehand
+	template<typename E>
+	void retire(CollectableEntries<E>& current, CollectableEntries<E>& old, int n)
+	{
+		old = current;
+		allocate(current, n);
 	}
-	bool findu(CollectableKeyHashEntry<K, V>** pair, const RootPtr<K>& key, bool for_insert) const
+	template<typename E>
+	void retire(std::vector<E>& current, std::vector<E>& old, int n)
 	{
-		uint64_t h = key->hash();
-		int start = h & (HASH_SIZE - 1);
-		int i = start;
-		CollectableKeyHashEntry<K, V>* recover = nullptr;
-		GC::safe_point();
-		do {
-			CollectableKeyHashEntry<K, V>* e = (*data)[i];
-			if (e->empty && !e->skip) {
-				if (recover != nullptr) {
-					*pair = recover;
-					recover->skip = false;
-					--wasted;
-				}
-				else *pair = e;
-				return false;
+		old.swap(current);
+		allocate(current, n);
+	}
+	template<typename E>
+	void release(CollectableEntries<E>& d) { d = (CollectableInlineVector<E>*)collectable_null; }
+	template<typename E>
+	void release(std::vector<E>& d) { std::vector<E>().swap(d); }
+
+	/* Table.
+	*
+	The probing, incremental migration and batched lookups that every table in this file shares.  Entry is the slot type,
+	it says how keys are hashed and compared and how a slot is filled, moved and emptied:
+	  typedef Key, Value             the key and value types the table is called with
+	  static uint32_t hash_of(key)   the mixed hash
+	  bool matches(h, key)           compares the stored hash before the keys
+	  void fill(key, value)          fills an empty slot
+	  void move_to(Entry& n)         moves a full slot into n, an empty slot in the new array, and leaves itself empty
+	  void release()                 empties a full slot
+	  Value get()                    the value in a full slot
+	Storage is a CollectableEntries<Entry> or a std::vector<Entry> and Base is Collectable or CollectableLeaf.  Derived
+	supplies Value missing() const, the result for a key that isn't there.
+	*/
+	template<typename Derived, typename Entry, typename Storage, typename Base>
+	struct Table :public Base
+	{
+		typedef typename Entry::Key Key;
+		typedef typename Entry::Value Value;
+
+		int HASH_SIZE;
+		int used;
+		mutable int wasted;
+		int migrate_pos;
+		Control control;
+		Control old_control;
+		Storage data;
+		Storage old_data;
+
+		Table(int s) :HASH_SIZE(nearest_power_of_2(s)), used(0), wasted(0), migrate_pos(0), control(HASH_SIZE)
+		{
+			allocate(data, HASH_SIZE);
+		}
+
+		void inc_used()
+		{
+			++used;
+			if (control.growth_left <= 0) {
+				finish_migration();
+				start_rehash(control.next_capacity(used));
+			}
+		}
+		//the old entries stay behind in old_data until migrate has moved all of them
+		void start_rehash(int new_size)
+		{
+			old_control = std::move(control);
+			migrate_pos = 0;
+			HASH_SIZE = new_size;
+			control = Control(HASH_SIZE);
+			retire(data, old_data, HASH_SIZE);
+			wasted = 0;
+#ifndef INCREMENTAL_REHASH
+			finish_migration();
+#endif
+		}
+		void migrate(int slots)
+		{
+			if (old_control.capacity == 0) return;
+			Entry* from = entries(old_data);
+			Entry* to = entries(data);
+			int end = migrate_pos + slots < old_control.capacity ? migrate_pos + slots : old_control.capacity;
+			for (; migrate_pos < end; ++migrate_pos) {
+				if (!old_control.full(migrate_pos)) continue;
+				Entry* e = from + migrate_pos;
+				int j = control.find_free(e->hash);
+				control.claim(j, e->hash);
+				to[j].hash = e->hash;
+				e->move_to(to[j]);
+				old_control.erase(migrate_pos);
+			}
+			if (migrate_pos == old_control.capacity) {
+				old_control = Control();
+				release(old_data);
+			}
+		}
+		void finish_migration()
+		{
+			while (old_control.capacity != 0) {
+				GC::safe_point();
+				migrate(1024);
+			}
+		}
+		//the entry for key in either array or nullptr, without a safe point
+		Entry* probe(uint32_t h, const Key& key) const
+		{
+			Entry* e = entries(data);
+			int i = control.find(h, [&](int i) { return e[i].matches(h, key); });
+			if (i >= 0) return e + i;
+			if (old_control.capacity != 0) {
+				Entry* old_e = entries(old_data);
+				i = old_control.find(h, [&](int i) { return old_e[i].matches(h, key); });
+				if (i >= 0) return old_e + i;
+			}
+			return nullptr;
+		}
+		bool findu(Entry** pair, const Key& key, bool for_insert) const
+		{
+			uint32_t h = Entry::hash_of(key);
+			GC::safe_point();
+			const_cast<Table*>(this)->migrate(HASH_MIGRATE_SLOTS);
+			Entry* found = probe(h, key);
+			if (found != nullptr) {
+				*pair = found;
+				return true;
+			}
+			if (for_insert) {
+				Entry* e = entries(data);
+				int i = control.find_free(h);
+				if (const_cast<Control&>(control).claim(i, h)) --wasted;
+				e[i].hash = h;
+				*pair = e + i;
+			}
+			return false;
+		}
+		//starts loading the tags and entries a probe for h will look at first
+		void prefetch(uint32_t h) const
+		{
+			SwissHash::prefetch(entries(data) + control.prefetch(h));
+			if (old_control.capacity != 0) SwissHash::prefetch(entries(old_data) + old_control.prefetch(h));
+		}
+		//Looks up keys[0..n) HASH_BATCH at a time: one safe point per batch, then every key in the batch is hashed and
+		//its home group prefetched before any of them are probed, so the cache misses overlap.
+		template <typename F>
+		void for_batch(const Key* keys, int n, F&& found) const
+		{
+			uint32_t h[HASH_BATCH];
+			for (int b = 0; b < n; b += HASH_BATCH) {
+				int e = n - b < HASH_BATCH ? n : b + HASH_BATCH;
+				for (int i = b; i < e; ++i) h[i - b] = Entry::hash_of(keys[i]);
+				GC::safe_point();
+				const_cast<Table*>(this)->migrate(HASH_MIGRATE_SLOTS);
+				for (int i = b; i < e; ++i) prefetch(h[i - b]);
+				for (int i = b; i < e; ++i) found(i, probe(h[i - b], keys[i]));
 			}
-			bool skip = e->skip;
-			if (for_insert && skip)
-			{
-				recover = e;
-				for_insert = false;
+		}
+		void find_many(const Key* keys, int n, Value* out) const
+		{
+			for_batch(keys, n, [&](int i, Entry* f) { out[i] = f != nullptr ? f->get() : static_cast<const Derived*>(this)->missing(); });
+		}
+		void contains_many(const Key* keys, int n, bool* out) const
+		{
+			for_batch(keys, n, [&](int i, Entry* f) { out[i] = f != nullptr; });
+		}
+		//findu can hand back a slot in either array
+		void erase_slot(Entry* pair)
+		{
+			Entry* e = entries(data);
+			if (pair >= e && pair < e + HASH_SIZE) {
+				control.erase((int)(pair - e));
+				++wasted;
 			}
-			if (!skip && h == e->key->hash() && e->key->equal(key.get())) {
-				*pair = e;
+			else old_control.erase((int)(pair - entries(old_data)));
+		}
+
+		bool contains(const Key& key) const {
+			Entry* pair = nullptr;
+			return findu(&pair, key, false);
+		}
+		Value operator[](const Key& key)
+		{
+			Entry* pair = nullptr;
+			if (findu(&pair, key, false)) return pair->get();
+			return static_cast<const Derived*>(this)->missing();
+		}
+		bool insert(const Key& key, const Value& value)
+		{
+			Entry* pair = nullptr;
+			if (!findu(&pair, key, true)) {
+				pair->fill(key, value);
+				inc_used();
+				return true;
+			}
+			return false;
+		}
+		void insert_or_assign(const Key& key, const Value& value)
+		{
+			Entry* pair = nullptr;
+			bool replacing = findu(&pair, key, true);
+			if (replacing) pair->release();
+			pair->fill(key, value);
+			if (!replacing) inc_used();
+		}
+		bool erase(const Key& key)
+		{
+			Entry* pair = nullptr;
+			if (findu(&pair, key, false)) {
+				erase_slot(pair);
+				pair->release();
+				used = used - 1;
 				return true;
 			}
+			return false;
+		}
+		int size() const { return used; }
+	};
+}
 
-			i = (i + 1) & (HASH_SIZE - 1);
-		} while (i != start);
-		assert(false);
-		return false;
-	}
 
-	bool contains(const RootPtr<K>& key) const {
-		CollectableKeyHashEntry<K, V>* pair = nullptr;
-		return findu(&pair, key, false);
-	}
-	V operator[](const RootPtr<K>& key)
-	{
-		CollectableKeyHashEntry<K, V>* pair = nullptr;
-		if (findu(&pair, key, false)) {
+template<typename K, typename V>
+struct CollectableKeyHashEntry
+{
+	typedef RootPtr<K> Key;
+	typedef V Value;
 
-			return pair->value();
-		}
-		return empty_v;
-	}
-	bool insert(const RootPtr<K>& key, const V& value)
+	uint32_t hash;
+	bool full;
+	InstancePtr<K> key;
+
+	alignas(alignof(V)) uint8_t value_bytes[sizeof(V)];
+	V& value() { return *(V*)&value_bytes[0]; }
+	const V& value() const { return *(V*)&value_bytes[0]; }
+	CollectableKeyHashEntry() :hash(0), full(false), key(static_cast<K *>(collectable_null)) {}
+	int total_instance_vars() const { return 1; }
+	InstancePtrBase* index_into_instance_vars(int num) { return &key;  }
+	~CollectableKeyHashEntry() { if (full) value().~V(); }
+
+	static uint32_t hash_of(const Key& k) { return SwissHash::mix(k->hash()); }
+	bool matches(uint32_t h, const Key& k) { return hash == h && key->equal(k.get()); }
+	void fill(const Key& k, const V& v)
 	{
-		CollectableKeyHashEntry<K, V>* pair = nullptr;
-		if (!findu(&pair, key, true)) {
-			pair->key = key;
-			//pair->value.~V();
-			new(&pair->value_bytes[0]) V(value);
-			pair->empty = false;
-			inc_used();
-			return true;
-		}
-		return false;
+		key = k;
+		new(&value_bytes[0]) V(v);
+		full = true;
 	}
-	void insert_or_assign(const RootPtr<K>& key, const V& value)
+	void move_to(CollectableKeyHashEntry& n)
 	{
-		CollectableKeyHashEntry<K, V>* pair = nullptr;
-		bool replacing=findu(&pair, key, true);
-		pair->key = key;
-		if (replacing) pair->value().~V();
-		new(&pair->value_bytes[0]) V(value);
-		pair->empty = false;
-		if (!replacing) inc_used();
+		n.key = key;
+		key = (K*)collectable_null;
+		new(&n.value_bytes[0]) V(std::move(value()));
+		value().~V();
+		full = false;
+		n.full = true;
 	}
-	bool erase(const RootPtr<K>& key)
+	void release()
 	{
-		CollectableKeyHashEntry<K, V>* pair = nullptr;
-		if (findu(&pair, key, false)) {
-			pair->skip = true;
-			pair->key = (K*)collectable_null;
-			pair->value().~V();
-			pair->empty = true;
-			used = used - 1;
-			++wasted;
-			return true;
-		}
-		return false;
+		key = (K*)collectable_null;
+		value().~V();
+		full = false;
 	}
-	int size() const { return used; }
+	V get() { return value(); }
+};
+
+template<typename K, typename V>
+struct CollectableKeyHashTable :public SwissHash::Table<CollectableKeyHashTable<K, V>, CollectableKeyHashEntry<K, V>, SwissHash::CollectableEntries<CollectableKeyHashEntry<K, V>>, Collectable>
+{
+	typedef SwissHash::Table<CollectableKeyHashTable<K, V>, CollectableKeyHashEntry<K, V>, SwissHash::CollectableEntries<CollectableKeyHashEntry<K, V>>, Collectable> Engine;
+	V empty_v;
+
+	CollectableKeyHashTable(const V& ev,int s = INITIAL_HASH_SIZE) :Engine(s), empty_v(ev) {}
+	V missing() const { return empty_v; }
 
 	virtual int total_instance_vars() const {
-		return 1;
+		return 2;
 	}
 	virtual size_t my_size() const { return sizeof(*this); }
-	virtual InstancePtrBase* index_into_instance_vars(int num) { return &data; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { if (num == 0) return &this->data; return &this->old_data; }
 };
 
 template<typename K, typename V>
 struct CollectableValueHashEntry
 {
-	bool skip;
-	bool empty;
+	typedef K Key;
+	typedef RootPtr<V> Value;
+
+	uint32_t hash;
+	bool full;
 	alignas(alignof(K)) uint8_t key_bytes[sizeof(K)];
 	K& key() { return *(K*)&key_bytes[0]; }
 	const K& key() const { return *(K*)&key_bytes[0]; }
 	InstancePtr<V> value;
-	CollectableValueHashEntry() :skip(false),empty(true), value((const V *)collectable_null) {}
+	CollectableValueHashEntry() :hash(0), full(false), value((const V *)collectable_null) {}
 	int total_instance_vars() const { return 1; }
 	InstancePtrBase* index_into_instance_vars(int num) { return &value; }
 	~CollectableValueHashEntry()
 	{
-		if (!empty) key().~K();
+		if (full) key().~K();
 	}
+
+	static uint32_t hash_of(const K& k) { return SwissHash::mix(std::hash<K>{}(k)); }
+	bool matches(uint32_t h, const K& k) { return hash == h && key() == k; }
+	void fill(const K& k, const RootPtr<V>& v)
+	{
+		new(&key_bytes[0]) K(k);
+		value = v;
+		full = true;
+	}
+	void move_to(CollectableValueHashEntry& n)
+	{
+		new(&n.key_bytes[0]) K(std::move(key()));
+		n.value = value;
+		value = (V*)collectable_null;
+		key().~K();
+		full = false;
+		n.full = true;
+	}
+	void release()
+	{
+		value = (V*)collectable_null;
+		full = false;
+		key().~K();
+	}
+	RootPtr<V> get() { return value.get(); }
 };
 
 template<typename K, typename V>
-struct CollectableValueHashTable :public Collectable
+struct CollectableValueHashTable :public SwissHash::Table<CollectableValueHashTable<K, V>, CollectableValueHashEntry<K, V>, SwissHash::CollectableEntries<CollectableValueHashEntry<K, V>>, Collectable>
 {
-	int HASH_SIZE;
-	int used;
-	mutable int wasted;
-	InstancePtr<CollectableInlineVector<CollectableValueHashEntry<K, V>>> data;
+	typedef SwissHash::Table<CollectableValueHashTable<K, V>, CollectableValueHashEntry<K, V>, SwissHash::CollectableEntries<CollectableValueHashEntry<K, V>>, Collectable> Engine;
 
+	CollectableValueHashTable(int s = INITIAL_HASH_SIZE) :Engine(s) {}
+	RootPtr<V> missing() const { return (V*)collectable_null; }
 
-	CollectableValueHashTable(int s = INITIAL_HASH_SIZE) :HASH_SIZE(nearest_power_of_2(s)), used(0), wasted(0), data(new CollectableInlineVector<CollectableValueHashEntry<K, V>>(HASH_SIZE)) {}
+	virtual int total_instance_vars() const {
+		return 2;
+	}
+	virtual size_t my_size() const { return sizeof(*this); }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { if (num == 0) return &this->data; return &this->old_data; }
+};
+
+
+
+template<typename K, typename V>
+struct CollectableHashEntry
+{
+	typedef RootPtr<K> Key;
+	typedef RootPtr<V> Value;
+
+	uint32_t hash;
+	bool full;
+	InstancePtr<K> key;
+	InstancePtr<V> value;
+	CollectableHashEntry() :hash(0), full(false) {}
+	int total_instance_vars() const { return 2; }
+	InstancePtrBase* index_into_instance_vars(int num) { if (num == 0) return &key; return &value; }
 
-	void inc_used()
+	static uint32_t hash_of(const Key& k) { return SwissHash::mix(k->hash()); }
+	bool matches(uint32_t h, const Key& k) { return hash == h && key->equal(k.get()); }
+	void fill(const Key& k, const Value& v)
 	{
-		++used;
-		if (((used + wasted) << 2) > HASH_SIZE)
-		{
-			int OLD_HASH_SIZE = HASH_SIZE;
-			HASH_SIZE <<= 1;
-			RootPtr<CollectableInlineVector<CollectableValueHashEntry<K, V> > > t = data;
-			data = new CollectableInlineVector<CollectableValueHashEntry<K, V> >(HASH_SIZE);
-			used = 0;
-			wasted = 0;
-			for (int i = 0; i < OLD_HASH_SIZE; ++i) {
-				GC::safe_point();
-				if (!t[i]->empty && !t[i]->skip) insert(t[i]->key(), t[i]->value);
-			}
-		}
+		key = k;
+		value = v;
+		full = true;
 	}
-	bool findu(CollectableValueHashEntry<K, V>** pair, const K& key, bool for_insert) const
+	void move_to(CollectableHashEntry& n)
 	{
-		size_t h = std::hash<K>{}(key);
-		int start = h & (HASH_SIZE - 1);
-		int i = start;
-		CollectableValueHashEntry<K, V>* recover = nullptr;
-		GC::safe_point();
-		do {
-			CollectableValueHashEntry<K, V>* e = data[i];
-			if (e->empty && !e->skip) {
-				if (recover != nullptr) {
-					*pair = recover;
-					recover->skip = false;
-					--wasted;
-				}
-				else *pair = e;
-				return false;
-			}
-			bool skip = e->skip;
-			if (for_insert && skip)
-			{
-				recover = e;
-				for_insert = false;
-			}
-			if (!skip && h == std::hash<K>{}(e->key()) && e->key() == key) {
-				*pair = e;
-				return true;
-			}
-
-			i = (i + 1) & (HASH_SIZE - 1);
-		} while (i != start);
-		assert(false);
-		return false;
+		n.key = key;
+		n.value = value;
+		key = (K*)collectable_null;
+		value = (V*)collectable_null;
+		full = false;
+		n.full = true;
 	}
+	void release()
+	{
+		key = (K*)collectable_null;
+		value = (V*)collectable_null;
+		full = false;
+	}
+	RootPtr<V> get() { return value.get(); }
+};
 
-	bool contains(const K& key) const {
-		CollectableValueHashEntry<K, V>* pair = nullptr;
-		return findu(&pair, key, false);
+template<typename K, typename V>
+struct CollectableHashTable :public SwissHash::Table<CollectableHashTable<K, V>, CollectableHashEntry<K, V>, SwissHash::CollectableEntries<CollectableHashEntry<K, V>>, Collectable>
+{
+	typedef SwissHash::Table<CollectableHashTable<K, V>, CollectableHashEntry<K, V>, SwissHash::CollectableEntries<CollectableHashEntry<K, V>>, Collectable> Engine;
+
+	CollectableHashTable(int s= INITIAL_HASH_SIZE) :Engine(s) {}
+	RootPtr<V> missing() const { return (V*)collectable_null; }
+
+	virtual int total_instance_vars() const {
+		return 2;
 	}
-	RootPtr<V> operator[](const K& key)
-	{
-		CollectableValueHashEntry<K, V>* pair = nullptr;
-		if (findu(&pair, key, false)) {
+	virtual size_t my_size() const { return sizeof(*this);  }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { if (num == 0) return &this->data; return &this->old_data; }
+};
+
+
+template<typename K, typename V>
+struct HashEntry
+{
+	typedef K Key;
+	typedef V Value;
 
-			return pair->value;
+	uint32_t hash;
+	bool full;
+	alignas(alignof(K)) uint8_t key_bytes[sizeof(K)];
+	K& key() { return *(K*)&key_bytes[0]; }
+	const K& key() const { return *(K*)&key_bytes[0]; }
+	alignas(alignof(V)) uint8_t value_bytes[sizeof(V)];
+	V& value() { return *(V*)&value_bytes[0]; }
+	const V& value() const { return *(V*)&value_bytes[0]; }
+	HashEntry() :hash(0),full(false) {}
+	HashEntry(const HashEntry& e) : hash(e.hash), full(e.full){
+		if (full) {
+			new (&key_bytes[0]) K(e.key());
+			new (&value_bytes[0]) V(e.value());
 		}
-		return (V*)collectable_null;
 	}
-	bool insert(const K& key, const RootPtr<V>& value)
+	~HashEntry()
 	{
-		CollectableValueHashEntry<K, V>* pair = nullptr;
-		if (!findu(&pair, key, true)) {
-			new(&pair->key_bytes[0]) K(key);
-			pair->value = value;
-			pair->empty = false;
-			inc_used();
-			return true;
+		if (full) {
+			key().~K();
+			value().~V();
 		}
-		return false;
 	}
-	void insert_or_assign(const K& key, const RootPtr<V>& value)
+
+	static uint32_t hash_of(const K& k) { return SwissHash::mix(std::hash<K>{}(k)); }
+	bool matches(uint32_t h, const K& k) { return hash == h && key() == k; }
+	void fill(const K& k, const V& v)
 	{
-		CollectableValueHashEntry<K, V>* pair = nullptr;
-		bool replacing=findu(&pair, key, true);
-		if(replacing) pair->key().~K();
-		new(&pair->key_bytes[0]) K(key);
-		pair->value = value;
-		pair->empty = false;
-		if (!replacing) inc_used();
+		new(&key_bytes[0]) K(k);
+		new(&value_bytes[0]) V(v);
+		full = true;
 	}
-	bool erase(const K& key)
+	void move_to(HashEntry& n)
 	{
-		CollectableValueHashEntry<K, V>* pair = nullptr;
-		if (findu(&pair, key, false)) {
-			pair->skip = true;
-			pair->value = (V*)collectable_null;
-			pair->empty = true;
-			pair->key().~K();
-			used = used - 1;
-			++wasted;
-			return true;
-		}
-		return false;
+		new(&n.key_bytes[0]) K(std::move(key()));
+		new(&n.value_bytes[0]) V(std::move(value()));
+		key().~K();
+		value().~V();
+		full = false;
+		n.full = true;
 	}
-	int size() const { return used; }
+	void release()
+	{
+		full = false;
+		key().~K();
+		value().~V();
+	}
+	V get() { return value(); }
+};
 
-	virtual int total_instance_vars() const {
-		return 1;
+template<typename K, typename V>
+struct HashTable :public SwissHash::Table<HashTable<K, V>, HashEntry<K, V>, std::vector<HashEntry<K, V>>, CollectableLeaf>
+{
+	typedef SwissHash::Table<HashTable<K, V>, HashEntry<K, V>, std::vector<HashEntry<K, V>>, CollectableLeaf> Engine;
+	V empty_v;
+
+
+	HashTable(const V& ev,int s = INITIAL_HASH_SIZE) :Engine(s),empty_v(ev) {}
+	V missing() const { return empty_v; }
+
+	void clear()
+	{
+		if (this->used > 0 || this->wasted > 0) {
+			for (int i = 0; i < this->HASH_SIZE; ++i) {
+				HashEntry<K, V>* pair = &this->data[i];
+				if (pair->full) pair->release();
+			}
+			this->control.clear();
+			this->wasted = 0;
+			this->used = 0;
+		}
+		//HashEntry's destructor frees whatever hadn't been migrated yet
+		SwissHash::release(this->old_data);
+		this->old_control = SwissHash::Control();
 	}
+
 	virtual size_t my_size() const { return sizeof(*this); }
-	virtual InstancePtrBase* index_into_instance_vars(int num) { return &data; }
 };
 
 
+/* A hash map that any number of mutator threads can use at once.
+*
+The keys are hashed into CONCURRENT_HASH_SHARDS shards, each with its own lock and its own array of bucket chains.
+Readers take no lock, they follow the chains with atomic loads.  Writers lock the shard, then publish with release stores:
+a new node is filled in before it is linked at the head of its chain, and erasing a node only unlinks it, so a reader that
+is already standing on it can still walk off the end.  Growing a shard copies its nodes into a new bucket array and then
+swaps the array in, the old chains are never changed so readers that loaded the old array are still fine.
+
+All of it is ordinary collectable storage, so the collector traces it like any other object.  A raw node pointer is only
+held between safe points, the same as findu above.
+*/
+
+#define CONCURRENT_HASH_SHARDS 64
+#define CONCURRENT_HASH_SHARD_BITS 6
+#define CONCURRENT_HASH_INITIAL_BUCKETS 16
 
 template<typename K, typename V>
-struct CollectableHashEntry 
+struct ConcurrentHashNode final :public TriviallyFinalized<ConcurrentHashNode<K, V>, Collectable, uint32_t, InstancePtr<K>, InstancePtr<V>, InstancePtr<ConcurrentHashNode<K, V>>>
 {
-	bool skip;
-	bool empty;
+	uint32_t hash;
 	InstancePtr<K> key;
 	InstancePtr<V> value;
-	CollectableHashEntry() :skip(false), empty(true) {}
-	int total_instance_vars() const { return 2; }
-	InstancePtrBase* index_into_instance_vars(int num) { if (num == 0) return &key; return &value; }
+	InstancePtr<ConcurrentHashNode<K, V>> next;
+	ConcurrentHashNode(uint32_t h, K* k, V* v, ConcurrentHashNode<K, V>* n) :hash(h), key(k), value(v), next(n) { this->log_size(sizeof(*this)); }
+	virtual int total_instance_vars() const { return 3; }
+	virtual InstancePtrBase* index_into_instance_vars(int num)
+	{
+		if (num == 0) return &key;
+		if (num == 1) return &value;
+		return &next;
+	}
 };
 
 template<typename K, typename V>
-struct CollectableHashTable :public Collectable
+struct ConcurrentHashBuckets :public CollectableSized<ConcurrentHashBuckets<K, V>, InstancePtr<ConcurrentHashNode<K, V>>>
 {
-	int HASH_SIZE;
-	int used;
-	mutable int wasted;
-	InstancePtr<CollectableInlineVector<CollectableHashEntry<K,V>>> data;
-
+	explicit ConcurrentHashBuckets(int s) :CollectableSized<ConcurrentHashBuckets<K, V>, InstancePtr<ConcurrentHashNode<K, V>>>(s) { this->log_size(sizeof(*this)); }
+	static ConcurrentHashBuckets* make(int s) { return GC::make_sized<ConcurrentHashBuckets>(s); }
+	int size() const { return this->trailing_size(); }
+	InstancePtr<ConcurrentHashNode<K, V>>& bucket(int i) { return this->trailing()[i]; }
+};
 
-	CollectableHashTable(int s= INITIAL_HASH_SIZE) :HASH_SIZE(nearest_power_of_2(s)), used(0), wasted(0), data(new CollectableInlineVector<CollectableHashEntry<K,V>>(HASH_SIZE)) {}
+template<typename K, typename V>
+struct ConcurrentCollectableHashMap :public Collectable
+{
+	typedef ConcurrentHashNode<K, V> Node;
+	typedef ConcurrentHashBuckets<K, V> Buckets;
 
-	void inc_used()
+	struct Shard
 	{
-		++used;
-		if (((used+wasted) << 2) > HASH_SIZE)
+		std::mutex lock;
+		//only written with the lock held, atomic so that size() can read it without
+		std::atomic_int count;
+		InstancePtr<Buckets> buckets;
+		//keeps the next shard's lock off of this one's cache line
+		uint8_t pad[GC::CacheLineSize];
+	};
+	//blocking on a shard while still mutating would hold up a collection that the lock holder may be waiting on
+	struct ShardLock
+	{
+		std::mutex& m;
+		ShardLock(std::mutex& l) :m(l)
 		{
-			int OLD_HASH_SIZE = HASH_SIZE;
-			HASH_SIZE <<= 1;
-			RootPtr<CollectableInlineVector<CollectableHashEntry<K,V> > > t ( data);
-			data = new CollectableInlineVector<CollectableHashEntry<K,V> >(HASH_SIZE);
-			used = 0;
-			wasted = 0;
-			for (int i = 0; i < OLD_HASH_SIZE; ++i) {
-				GC::safe_point();
-				if (!t[i]->empty) insert(t[i]->key, t[i]->value);
+			if (!m.try_lock()) {
+				GC::LeaveMutationRAII leave;
+				m.lock();
 			}
 		}
+		~ShardLock() { m.unlock(); }
+	};
+
+	Shard shards[CONCURRENT_HASH_SHARDS];
+
+	ConcurrentCollectableHashMap()
+	{
+		for (int i = 0; i < CONCURRENT_HASH_SHARDS; ++i) {
+			shards[i].count = 0;
+			shards[i].buckets = Buckets::make(CONCURRENT_HASH_INITIAL_BUCKETS);
+		}
+		log_size(sizeof(*this));
+	}
+
+	static uint32_t bucket_of(const Buckets* b, uint32_t h) { return (h >> CONCURRENT_HASH_SHARD_BITS) & (b->size() - 1); }
+
+	Node* find_node(Node* n, uint32_t h, const Collectable* key) const
+	{
+		for (; n != collectable_null; n = n->next.load(std::memory_order_acquire)) {
+			if (n->hash == h && n->key->equal(key)) return n;
+		}
+		return nullptr;
 	}
-	bool findu(CollectableHashEntry<K, V>**pair ,const RootPtr<K> &key, bool for_insert) const
+	Node* lookup(const RootPtr<K>& key) const
 	{
-		uint64_t h = key->hash();
-		int start = h & (HASH_SIZE - 1);
-		int i = start;
-		CollectableHashEntry<K, V>* recover=nullptr;
+		uint32_t h = SwissHash::mix(key->hash());
 		GC::safe_point();
-		do {
-			CollectableHashEntry<K, V>* e = data[i];
-			if (e->empty && !e->skip) {
-				if (recover != nullptr) {
-					*pair = recover;
-					recover->skip = false;
-					--wasted;
-				}
-				else *pair = e;
-				return false;
-			}
-			bool skip = e->skip;
-			if (for_insert && skip)
-			{
-				recover = e;
-				for_insert = false;
-			}
-			if (!skip && h == e->key->hash() && e->key->equal(key.get())) {
-				*pair = e;
-				return true;
-			}
-
-			i = (i + 1) & (HASH_SIZE - 1);
-		} while (i != start);
-		assert(false);
-		return false;
+		Buckets* b = shards[h & (CONCURRENT_HASH_SHARDS - 1)].buckets.load(std::memory_order_acquire);
+		return find_node(b->bucket(bucket_of(b, h)).load(std::memory_order_acquire), h, key.get());
 	}
 
-	bool contains(const RootPtr<K> &key) const {
-		CollectableHashEntry<K, V>* pair = nullptr;
-		return findu(&pair, key, false);
+	bool contains(const RootPtr<K>& key) const { return lookup(key) != nullptr; }
+	RootPtr<V> operator[](const RootPtr<K>& key) const
+	{
+		Node* n = lookup(key);
+		if (n == nullptr) return (V*)collectable_null;
+		return n->value.load(std::memory_order_acquire);
 	}
-	RootPtr<V> operator[](const RootPtr<K>& key)
+	//assign says what to do with a key that's already there, returns true if the key was new
+	bool put(const RootPtr<K>& key, const RootPtr<V>& value, bool assign)
 	{
-		CollectableHashEntry<K, V>* pair = nullptr;
-		if (findu(&pair, key, false)) {
-
-			return pair->value;
+		uint32_t h = SwissHash::mix(key->hash());
+		GC::safe_point();
+		Shard& s = shards[h & (CONCURRENT_HASH_SHARDS - 1)];
+		ShardLock l(s.lock);
+		Buckets* b = s.buckets.get();
+		InstancePtr<Node>& head = b->bucket(bucket_of(b, h));
+		Node* n = find_node(head.get(), h, key.get());
+		if (n != nullptr) {
+			if (assign) n->value.store(value.get(), std::memory_order_release);
+			return false;
 		}
-		return (V *)collectable_null;
+		head.store(new Node(h, key.get(), value.get(), head.get()), std::memory_order_release);
+		if (++s.count > b->size()) grow(s);
+		return true;
 	}
-	bool insert(const RootPtr<K>& key, const RootPtr<V>& value)
+	bool insert(const RootPtr<K>& key, const RootPtr<V>& value) { return put(key, value, false); }
+	void insert_or_assign(const RootPtr<K>& key, const RootPtr<V>& value) { put(key, value, true); }
+	bool erase(const RootPtr<K>& key)
 	{
-		CollectableHashEntry<K, V>* pair = nullptr;
-		if (!findu(&pair, key, true)) {
-			pair->key = key;
-			pair->value = value;
-			pair->empty = false;
-			inc_used();
-			return true;
+		uint32_t h = SwissHash::mix(key->hash());
+		GC::safe_point();
+		Shard& s = shards[h & (CONCURRENT_HASH_SHARDS - 1)];
+		ShardLock l(s.lock);
+		Buckets* b = s.buckets.get();
+		InstancePtr<Node>* link = &b->bucket(bucket_of(b, h));
+		for (Node* n = link->get(); n != collectable_null; n = link->get()) {
+			if (n->hash == h && n->key->equal(key.get())) {
+				link->store(n->next.get(), std::memory_order_release);
+				--s.count;
+				return true;
+			}
+			link = &n->next;
 		}
 		return false;
 	}
-	void insert_or_assign(const RootPtr<K>& key, const RootPtr<V>& value)
+	//the total can be stale by the time it's returned if other threads are writing
+	int size() const
 	{
-		CollectableHashEntry<K, V>* pair = nullptr;
-		bool replacing =findu(&pair, key, true);
-		pair->key = key;
-		pair->value = value;
-		pair->empty = false;
-
-		if (!replacing) inc_used();
+		int total = 0;
+		for (int i = 0; i < CONCURRENT_HASH_SHARDS; ++i) total += shards[i].count.load(std::memory_order_relaxed);
+		return total;
 	}
-	bool erase(const RootPtr<K>& key)
+	//called with the shard locked
+	void grow(Shard& s)
 	{
-		CollectableHashEntry<K, V>* pair = nullptr;
-		if (findu(&pair, key, false)) {
-			pair->skip = true;
-			pair->key = (K*)collectable_null;
-			pair->value = (V*)collectable_null;
-			pair->empty = true;
-			used = used - 1;
-			++wasted;
-			return true;
+		Buckets* b = s.buckets.get();
+		Buckets* nb = Buckets::make(b->size() << 1);
+		for (int i = 0; i < b->size(); ++i) {
+			for (Node* n = b->bucket(i).get(); n != collectable_null; n = n->next.get()) {
+				InstancePtr<Node>& head = nb->bucket(bucket_of(nb, n->hash));
+				head = new Node(n->hash, n->key.get(), n->value.get(), head.get());
+			}
 		}
-		return false;
+		s.buckets.store(nb, std::memory_order_release);
 	}
-	int size() const { return used; }
 
-	virtual int total_instance_vars() const {
-		return 1;
-	}
-	virtual size_t my_size() const { return sizeof(*this);  }
-	virtual InstancePtrBase* index_into_instance_vars(int num) { return &data; }
+	virtual int total_instance_vars() const { return CONCURRENT_HASH_SHARDS; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return &shards[num].buckets; }
 };
 
+/* A hash table that holds its keys weakly, as ephemerons: an entry keeps its value alive only while its key is
+reachable from outside of the table, so a memo cache keyed by request objects lets go of the results when the requests
+are gone.  Keys are compared with equal(), but it's the key object stored in the table that has to stay reachable.
+*
+The keys and values live in an EphemeronBlock, which the marker doesn't look inside.  Once everything else is marked,
+the collector calls mark_ephemerons() until nothing more turns up, and each time the table marks, from the snapshot,
+the values whose keys have been marked.  Then clear_dying() drops the entries whose keys are dying.  The collector
+takes the table's lock for that, and a lookup passes the key it found through GC::weak_read() before using it, so a
+value the collector has given up on is never handed out.
+Any number of threads can use the table, they all take the one lock.
+*/
 
-template<typename K, typename V>
-struct HashEntry
+#define WEAK_KEY_HASH_INITIAL_SIZE 64
+
+//Entry i of a WeakKeyCollectableHashTable is key(i) and value(i).  The restore passes see all of them.
+struct EphemeronBlock : public CollectableSized<EphemeronBlock, InstancePtr<Collectable>>
 {
-	bool skip;
-	bool empty;
-	alignas(alignof(K)) uint8_t key_bytes[sizeof(K)];
-	K& key() { return *(K*)&key_bytes[0]; }
-	const K& key() const { return *(K*)&key_bytes[0]; }
-	alignas(alignof(V)) uint8_t value_bytes[sizeof(V)];
-	V& value() { return *(V*)&value_bytes[0]; }
-	const V& value() const { return *(V*)&value_bytes[0]; }
-	HashEntry() :skip(false),empty(true) {}
-	HashEntry(const HashEntry& e) : skip(e.skip), empty(e.empty){
-		if (!empty) {
-			new (&key_bytes[0]) K(e.key());
-			new (&value_bytes[0]) V(e.value());
-		}
-	}
-	~HashEntry()
-	{
-		if (!empty) {
-			key().~K();
-			value().~V();
-		}
-	}
+	//n is twice the number of entries
+	explicit EphemeronBlock(int n) :CollectableSized<EphemeronBlock, InstancePtr<Collectable>>(n) { collectable_untraced = true; }
+	int capacity() const { return trailing_size() >> 1; }
+	InstancePtr<Collectable>& key(int i) { return trailing()[2 * i]; }
+	InstancePtr<Collectable>& value(int i) { return trailing()[2 * i + 1]; }
 };
 
 template<typename K, typename V>
-struct HashTable :public Collectable
+struct WeakKeyCollectableHashTable :public Collectable, public GC::WeakHolder
 {
-	int HASH_SIZE;
+	std::mutex lock;
+	SwissHash::Control control;
+	std::unique_ptr<uint32_t[]> hashes;
 	int used;
-	mutable int wasted;
-	std::vector<HashEntry<K, V>> data;
-	V empty_v;
-
-
-	HashTable(const V& ev,int s = INITIAL_HASH_SIZE) :HASH_SIZE(nearest_power_of_2(s)), used(0), wasted(0), data(HASH_SIZE),empty_v(ev) {}
+	InstancePtr<EphemeronBlock> data;
 
-	void inc_used()
+	//the same as ConcurrentCollectableHashMap::ShardLock
+	struct TableLock
 	{
-		++used;
-		if (((used + wasted) << 2) > HASH_SIZE)
+		std::mutex& m;
+		TableLock(std::mutex& l) :m(l)
 		{
-			int OLD_HASH_SIZE = HASH_SIZE;
-			HASH_SIZE <<= 1;
-			std::vector<HashEntry<K, V>> t = data;
-			data.clear();
-			data.resize(HASH_SIZE);
-			used = 0;
-			wasted = 0;
-			for (int i = 0; i < OLD_HASH_SIZE; ++i) {
-				GC::safe_point();
-				if (!t[i].empty) insert(t[i].key(), t[i].value());
+			if (!m.try_lock()) {
+				GC::LeaveMutationRAII leave;
+				m.lock();
 			}
 		}
-	}
-	bool findu(HashEntry<K, V>** pair, const K& key, bool for_insert) const
-	{
-		size_t h = std::hash<K>{}(key);
-		int start = h & (HASH_SIZE - 1);
-		int i = start;
-		HashEntry<K, V>* recover = nullptr;
-		GC::safe_point();
-		do {
-			HashEntry<K, V>* e = const_cast<HashEntry<K, V>*>(&data[i]);
-			if (e->empty && !e->skip) {
-				if (recover != nullptr) {
-					*pair = recover;
-					recover->skip = false;
-					--wasted;
-				}
-				else *pair = e;
-				return false;
-			}
-			bool skip = e->skip;
-			if (for_insert && skip)
-			{
-				recover = e;
-				for_insert = false;
-			}
-			if (!skip && h == std::hash<K>{}(e->key()) && e->key() == key) {
-				*pair = e;
-				return true;
-			}
+		~TableLock() { m.unlock(); }
+	};
 
-			i = (i + 1) & (HASH_SIZE - 1);
-		} while (i != start);
-		assert(false);
-		return false;
+	WeakKeyCollectableHashTable(int s = WEAK_KEY_HASH_INITIAL_SIZE) :control(nearest_power_of_2(s)), hashes(new uint32_t[control.capacity]), used(0), data(GC::make_sized<EphemeronBlock>(2 * control.capacity))
+	{
+		log_size(sizeof(*this) + control.capacity * (sizeof(uint32_t) + 1));
+		weak_register();
 	}
+	~WeakKeyCollectableHashTable() { weak_unregister(); }
 
-	bool contains(const K& key) const {
-		HashEntry<K, V>* pair = nullptr;
-		return findu(&pair, key, false);
+	//with the lock held.  A key that's dying is as good as gone, an entry added for an equal key can come after it
+	int find_slot(uint32_t h, const Collectable* key)
+	{
+		EphemeronBlock* b = data.get();
+		return control.find(h, [&](int i) {
+			if (hashes[i] != h) return false;
+			Collectable* k = b->key(i).get();
+			return k->equal(key) && GC::weak_read(k->getHandle()) != GC::NULLHandle;
+		});
 	}
-	V operator[](const K& key)
+	//with the lock held.  Entries with dying keys come along too, clear_dying() looks at whichever block is current
+	void rehash(int capacity)
 	{
-		HashEntry<K, V>* pair = nullptr;
-		if (findu(&pair, key, false)) {
-
-			return pair->value();
+		SwissHash::Control c(capacity);
+		std::unique_ptr<uint32_t[]> hs(new uint32_t[capacity]);
+		EphemeronBlock* from = data.get();
+		EphemeronBlock* to = GC::make_sized<EphemeronBlock>(2 * capacity);
+		for (int i = 0; i < control.capacity; ++i) {
+			if (!control.full(i)) continue;
+			int j = c.find_free(hashes[i]);
+			c.claim(j, hashes[i]);
+			hs[j] = hashes[i];
+			to->key(j) = from->key(i);
+			to->value(j) = from->value(i);
 		}
-		return empty_v;
+		log_size((capacity - control.capacity) * (sizeof(uint32_t) + 1));
+		control = std::move(c);
+		hashes = std::move(hs);
+		data = to;
 	}
-	bool insert(const K& key, const V& value)
-	{
-		HashEntry<K, V>* pair = nullptr;
-		if (!findu(&pair, key, true)) {
 
-			new(&pair->key_bytes[0]) K(key);
-
-			new(&pair->value_bytes[0]) V(value);
-			pair->empty = false;
-			inc_used();
-			return true;
-		}
-		return false;
+	RootPtr<V> operator[](const RootPtr<K>& key)
+	{
+		uint32_t h = SwissHash::mix(key->hash());
+		GC::safe_point();
+		TableLock l(lock);
+		int i = find_slot(h, key.get());
+		if (i < 0) return (V*)collectable_null;
+		return static_cast<V*>(data->value(i).get());
 	}
-	void insert_or_assign(const K& key, const V& value)
+	bool contains(const RootPtr<K>& key)
 	{
-		HashEntry<K, V>* pair = nullptr;
-		bool replacing=findu(&pair, key, true);
-		if (replacing) {
-			pair->key().~K();
-			pair->value().~V();
+		uint32_t h = SwissHash::mix(key->hash());
+		GC::safe_point();
+		TableLock l(lock);
+		return find_slot(h, key.get()) >= 0;
+	}
+	//returns true if the key was new
+	bool insert_or_assign(const RootPtr<K>& key, const RootPtr<V>& value)
+	{
+		uint32_t h = SwissHash::mix(key->hash());
+		GC::safe_point();
+		TableLock l(lock);
+		int i = find_slot(h, key.get());
+		if (i >= 0) {
+			data->value(i) = value.get();
+			return false;
 		}
-		new(&pair->key_bytes[0]) K(key);
-		new(&pair->value_bytes[0]) V(value);
-		pair->empty = false;
-		if (!replacing) inc_used();
+		if (control.growth_left == 0) rehash(control.next_capacity(used));
+		i = control.find_free(h);
+		control.claim(i, h);
+		hashes[i] = h;
+		EphemeronBlock* b = data.get();
+		b->key(i) = key.get();
+		b->value(i) = value.get();
+		++used;
+		return true;
 	}
-	void clear()
+	bool erase(const RootPtr<K>& key)
 	{
-		if (used > 0) {
-			for (int i = 0; i < HASH_SIZE; ++i) {
-				HashEntry<K, V>* pair = &data[i];
-				if (!pair->empty) {
-					pair->key().~K();
-					pair->value().~V();
-				}
-				pair->empty = true;
-				pair->skip = false;
+		uint32_t h = SwissHash::mix(key->hash());
+		GC::safe_point();
+		TableLock l(lock);
+		int i = find_slot(h, key.get());
+		if (i < 0) return false;
+		control.erase(i);
+		--used;
+		EphemeronBlock* b = data.get();
+		b->key(i) = collectable_null;
+		b->value(i) = collectable_null;
+		return true;
+	}
+	//counts entries whose keys died since the last collection
+	int size()
+	{
+		TableLock l(lock);
+		return used;
+	}
+
+	//only reads the snapshot, which mutators don't write while collecting, so it doesn't need the lock
+	virtual bool mark_ephemerons()
+	{
+		if (!GC::is_marked(this)) return false;
+		Collectable* d = data.get_collectable();
+		if (d == collectable_null) return false;
+		EphemeronBlock* b = static_cast<EphemeronBlock*>(d);
+		bool marked = false;
+		for (int i = 0, n = b->capacity(); i < n; ++i) {
+			Collectable* k = b->key(i).get_collectable();
+			if (k == collectable_null || !GC::is_marked(k)) continue;
+			Collectable* v = b->value(i).get_collectable();
+			if (v != collectable_null && !GC::is_marked(v)) {
+				v->collectable_mark();
+				marked = true;
 			}
-			wasted = 0;
-			used = 0;
 		}
+		return marked;
 	}
-	bool erase(const K& key)
+	//The collector isn't a mutator, so it stores both halves.  Marking is over and nothing needs the old snapshot.
+	virtual void clear_dying()
 	{
-		HashEntry<K, V>* pair = nullptr;
-		if (findu(&pair, key, false)) {
-			pair->skip = true;
-			pair->empty = true;
-			used = used - 1;
-			pair->key().~K();
-			pair->value().~V();
-			++wasted;
-			return true;
+		if (GC::is_dying(this)) return;
+		std::lock_guard<std::mutex> l(lock);
+		EphemeronBlock* b = data.get();
+		for (int i = 0; i < control.capacity; ++i) {
+			if (!control.full(i) || !GC::is_dying(b->key(i).getHandle())) continue;
+			control.erase(i);
+			--used;
+			GC::double_ptr_store(&b->key(i).value, GC::NULLHandle);
+			GC::double_ptr_store(&b->value(i).value, GC::NULLHandle);
 		}
-		return false;
 	}
-	int size() const { return used; }
 
-	virtual int total_instance_vars() const {
-		return 0;
-	}
-	virtual size_t my_size() const { return sizeof(*this); }
-	virtual InstancePtrBase* index_into_instance_vars(int num) { return nullptr; }
+	virtual int total_instance_vars() const { return 1; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return &data; }
 };
-
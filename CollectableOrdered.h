@@ -0,0 +1,803 @@
+#pragma once
+#include "Collectable.h"
+#include <functional>
+#include <algorithm>
+#include <vector>
+
+
+/* An ordered map from value type keys to collectables, as a B+ tree.
+*
+1) The keys are any type that is default constructible, copyable and ordered by Compare (std::less by default).  They are
+stored inline, BTREE_NODE_KEYS to a node, so a search reads a few sorted arrays instead of chasing a pointer per key.
+2) The values are collectables, held by InstancePtr in the leaves.  Every node is a collectable and traces its InstancePtrs
+through index_into_instance_vars like anything else.
+3) All of the values are in the leaves and the leaves are linked in order, so range scans just walk the leaf chain.
+
+Nodes other than the root are kept at least half full, erase borrows from or merges with a neighbour when one gets too small.
+Iterators hold a root on their leaf but like std::map's they are invalidated by inserting or erasing.
+
+ */
+
+#define BTREE_NODE_KEYS 32
+
+template<typename K>
+struct BTreeNode :public Collectable
+{
+	int count;
+	bool leaf;
+	K keys[BTREE_NODE_KEYS];
+	BTreeNode(bool l) :count(0), leaf(l) {}
+};
+
+template<typename K, typename V>
+struct BTreeLeaf :public BTreeNode<K>
+{
+	InstancePtr<V> values[BTREE_NODE_KEYS];
+	InstancePtr<BTreeLeaf<K, V>> next;
+	BTreeLeaf() :BTreeNode<K>(true) { this->log_size(sizeof(*this)); }
+	//all of them, not just count, the collector may be looking while count changes
+	virtual int total_instance_vars() const { return BTREE_NODE_KEYS + 1; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { if (num == BTREE_NODE_KEYS) return &next; return &values[num]; }
+};
+
+template<typename K>
+struct BTreeInner :public BTreeNode<K>
+{
+	//child[i] holds the keys less than keys[i], child[i+1] the ones greater or equal
+	InstancePtr<BTreeNode<K>> child[BTREE_NODE_KEYS + 1];
+	BTreeInner() :BTreeNode<K>(false) { this->log_size(sizeof(*this)); }
+	virtual int total_instance_vars() const { return BTREE_NODE_KEYS + 1; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return &child[num]; }
+};
+
+template<typename K, typename V, typename Compare = std::less<K>>
+struct CollectableBTreeMap :public Collectable
+{
+	typedef BTreeNode<K> Node;
+	typedef BTreeLeaf<K, V> Leaf;
+	typedef BTreeInner<K> Inner;
+
+	int used;
+	Compare compare;
+	InstancePtr<Node> root;
+
+	CollectableBTreeMap() :used(0), root(new Leaf) { log_size(sizeof(*this)); }
+
+	struct iterator
+	{
+		RootPtr<Leaf> leaf;
+		int pos;
+		iterator() :leaf((Leaf*)collectable_null), pos(0) {}
+		iterator(Leaf* l, int p) :leaf(l), pos(p) { skip(); }
+		//declared so that iterators are never moved, RootPtr's move leaves both sides sharing one letter
+		iterator(const iterator& o) :leaf(o.leaf), pos(o.pos) {}
+		iterator& operator=(const iterator& o) { leaf = o.leaf; pos = o.pos; return *this; }
+		//moves past the end of a leaf onto the start of the next one
+		void skip()
+		{
+			while (leaf.get() != collectable_null && pos == leaf->count) {
+				leaf = leaf->next;
+				pos = 0;
+			}
+		}
+		bool operator==(const iterator& o) const { return leaf.get() == o.leaf.get() && pos == o.pos; }
+		bool operator!=(const iterator& o) const { return !(*this == o); }
+		iterator& operator++() { ++pos; skip(); return *this; }
+		const K& key() const { return leaf->keys[pos]; }
+		RootPtr<V> value() const { return leaf->values[pos]; }
+	};
+
+	static int min_count(const Node* n) { return n->leaf ? BTREE_NODE_KEYS / 2 : BTREE_NODE_KEYS / 2 - 1; }
+	//first i with keys[i] >= k
+	int lower(const Node* n, const K& k) const
+	{
+		int lo = 0, hi = n->count;
+		while (lo < hi) {
+			int mid = (lo + hi) >> 1;
+			if (compare(n->keys[mid], k)) lo = mid + 1;
+			else hi = mid;
+		}
+		return lo;
+	}
+	//first i with keys[i] > k
+	int upper(const Node* n, const K& k) const
+	{
+		int lo = 0, hi = n->count;
+		while (lo < hi) {
+			int mid = (lo + hi) >> 1;
+			if (compare(k, n->keys[mid])) hi = mid;
+			else lo = mid + 1;
+		}
+		return lo;
+	}
+	Leaf* find_leaf(const K& k) const
+	{
+		Node* n = root.get();
+		while (!n->leaf) n = static_cast<Inner*>(n)->child[upper(n, k)].get();
+		return static_cast<Leaf*>(n);
+	}
+
+	bool contains(const K& key) const
+	{
+		GC::safe_point();
+		Leaf* l = find_leaf(key);
+		int i = lower(l, key);
+		return i < l->count && !compare(key, l->keys[i]);
+	}
+	RootPtr<V> operator[](const K& key) const
+	{
+		GC::safe_point();
+		Leaf* l = find_leaf(key);
+		int i = lower(l, key);
+		if (i < l->count && !compare(key, l->keys[i])) return l->values[i];
+		return (V*)collectable_null;
+	}
+	iterator begin() const
+	{
+		GC::safe_point();
+		Node* n = root.get();
+		while (!n->leaf) n = static_cast<Inner*>(n)->child[0].get();
+		return iterator(static_cast<Leaf*>(n), 0);
+	}
+	iterator end() const { return iterator(); }
+	iterator lower_bound(const K& key) const
+	{
+		GC::safe_point();
+		Leaf* l = find_leaf(key);
+		return iterator(l, lower(l, key));
+	}
+	iterator upper_bound(const K& key) const
+	{
+		GC::safe_point();
+		Leaf* l = find_leaf(key);
+		return iterator(l, upper(l, key));
+	}
+	//Calls f(key, value) for every key in [from, to) in order, straight off of the leaves with a safe point per leaf.
+	//f must not change the map.
+	template <typename F>
+	void scan(const K& from, const K& to, F&& f) const
+	{
+		GC::safe_point();
+		Leaf* l = find_leaf(from);
+		for (int i = lower(l, from);; i = 0) {
+			for (; i < l->count; ++i) {
+				if (!compare(l->keys[i], to)) return;
+				f(static_cast<const K&>(l->keys[i]), static_cast<const InstancePtr<V>&>(l->values[i]));
+			}
+			l = l->next.get();
+			if (l == collectable_null) return;
+			GC::safe_point();
+		}
+	}
+
+	//splits the full child i of p in two and puts the separator into p, p can't be full
+	void split_child(Inner* p, int i)
+	{
+		Node* c = p->child[i].get();
+		Node* r;
+		K sep;
+		int mid = BTREE_NODE_KEYS / 2;
+		if (c->leaf) {
+			Leaf* cl = static_cast<Leaf*>(c);
+			Leaf* rl = new Leaf;
+			rl->count = c->count - mid;
+			std::move(cl->keys + mid, cl->keys + c->count, rl->keys);
+			GC::copy_range(rl->values, cl->values + mid, rl->count);
+			GC::fill_range(cl->values + mid, (V*)collectable_null, rl->count);
+			rl->next = cl->next;
+			cl->next = rl;
+			sep = rl->keys[0];
+			r = rl;
+		}
+		else {
+			Inner* ci = static_cast<Inner*>(c);
+			Inner* ri = new Inner;
+			ri->count = c->count - mid - 1;
+			sep = std::move(ci->keys[mid]);
+			std::move(ci->keys + mid + 1, ci->keys + c->count, ri->keys);
+			GC::copy_range(ri->child, ci->child + mid + 1, ri->count + 1);
+			GC::fill_range(ci->child + mid + 1, (Node*)collectable_null, ri->count + 1);
+			r = ri;
+		}
+		c->count = mid;
+		std::move_backward(p->keys + i, p->keys + p->count, p->keys + p->count + 1);
+		GC::move_range(p->child + i + 2, p->child + i + 1, p->count - i);
+		p->keys[i] = std::move(sep);
+		p->child[i + 1] = r;
+		++p->count;
+	}
+	//assign says what to do with a key that's already there, returns true if the key was new
+	bool put(const K& key, const RootPtr<V>& value, bool assign)
+	{
+		GC::safe_point();
+		if (root->count == BTREE_NODE_KEYS) {
+			Inner* r = new Inner;
+			r->child[0] = root.get();
+			split_child(r, 0);
+			root = r;
+		}
+		//full nodes are split on the way down so there's always room for a separator coming up
+		Node* n = root.get();
+		while (!n->leaf) {
+			Inner* in = static_cast<Inner*>(n);
+			int i = upper(in, key);
+			if (in->child[i]->count == BTREE_NODE_KEYS) {
+				split_child(in, i);
+				if (!compare(key, in->keys[i])) ++i;
+			}
+			n = in->child[i].get();
+		}
+		Leaf* l = static_cast<Leaf*>(n);
+		int i = lower(l, key);
+		if (i < l->count && !compare(key, l->keys[i])) {
+			if (assign) l->values[i] = value;
+			return false;
+		}
+		std::move_backward(l->keys + i, l->keys + l->count, l->keys + l->count + 1);
+		GC::move_range(l->values + i + 1, l->values + i, l->count - i);
+		l->keys[i] = key;
+		l->values[i] = value;
+		++l->count;
+		++used;
+		return true;
+	}
+	bool insert(const K& key, const RootPtr<V>& value) { return put(key, value, false); }
+	void insert_or_assign(const K& key, const RootPtr<V>& value) { put(key, value, true); }
+
+	//moves the last entry of child i-1 to the front of child i
+	void borrow_left(Inner* p, int i)
+	{
+		Node* c = p->child[i].get();
+		Node* l = p->child[i - 1].get();
+		std::move_backward(c->keys, c->keys + c->count, c->keys + c->count + 1);
+		if (c->leaf) {
+			Leaf* cl = static_cast<Leaf*>(c);
+			Leaf* ll = static_cast<Leaf*>(l);
+			GC::move_range(cl->values + 1, cl->values, c->count);
+			c->keys[0] = std::move(l->keys[l->count - 1]);
+			cl->values[0] = ll->values[l->count - 1];
+			ll->values[l->count - 1] = (V*)collectable_null;
+			p->keys[i - 1] = c->keys[0];
+		}
+		else {
+			Inner* ci = static_cast<Inner*>(c);
+			Inner* li = static_cast<Inner*>(l);
+			GC::move_range(ci->child + 1, ci->child, c->count + 1);
+			c->keys[0] = std::move(p->keys[i - 1]);
+			ci->child[0] = li->child[l->count];
+			li->child[l->count] = (Node*)collectable_null;
+			p->keys[i - 1] = std::move(l->keys[l->count - 1]);
+		}
+		--l->count;
+		++c->count;
+	}
+	//moves the first entry of child i+1 to the end of child i
+	void borrow_right(Inner* p, int i)
+	{
+		Node* c = p->child[i].get();
+		Node* r = p->child[i + 1].get();
+		if (c->leaf) {
+			Leaf* cl = static_cast<Leaf*>(c);
+			Leaf* rl = static_cast<Leaf*>(r);
+			c->keys[c->count] = std::move(r->keys[0]);
+			cl->values[c->count] = rl->values[0];
+			std::move(r->keys + 1, r->keys + r->count, r->keys);
+			GC::move_range(rl->values, rl->values + 1, r->count - 1);
+			rl->values[r->count - 1] = (V*)collectable_null;
+			--r->count;
+			p->keys[i] = r->keys[0];
+		}
+		else {
+			Inner* ci = static_cast<Inner*>(c);
+			Inner* ri = static_cast<Inner*>(r);
+			c->keys[c->count] = std::move(p->keys[i]);
+			ci->child[c->count + 1] = ri->child[0];
+			p->keys[i] = std::move(r->keys[0]);
+			std::move(r->keys + 1, r->keys + r->count, r->keys);
+			GC::move_range(ri->child, ri->child + 1, r->count);
+			ri->child[r->count] = (Node*)collectable_null;
+			--r->count;
+		}
+		++c->count;
+	}
+	//folds child i+1 into child i and drops it from p
+	void merge(Inner* p, int i)
+	{
+		Node* l = p->child[i].get();
+		Node* r = p->child[i + 1].get();
+		if (l->leaf) {
+			Leaf* ll = static_cast<Leaf*>(l);
+			Leaf* rl = static_cast<Leaf*>(r);
+			std::move(r->keys, r->keys + r->count, l->keys + l->count);
+			GC::copy_range(ll->values + l->count, rl->values, r->count);
+			ll->next = rl->next;
+			l->count += r->count;
+		}
+		else {
+			Inner* li = static_cast<Inner*>(l);
+			Inner* ri = static_cast<Inner*>(r);
+			l->keys[l->count] = std::move(p->keys[i]);
+			std::move(r->keys, r->keys + r->count, l->keys + l->count + 1);
+			GC::copy_range(li->child + l->count + 1, ri->child, r->count + 1);
+			l->count += r->count + 1;
+		}
+		std::move(p->keys + i + 1, p->keys + p->count, p->keys + i);
+		GC::move_range(p->child + i + 1, p->child + i + 2, p->count - i - 1);
+		p->child[p->count] = (Node*)collectable_null;
+		--p->count;
+	}
+	bool erase_from(Node* n, const K& key)
+	{
+		if (n->leaf) {
+			Leaf* l = static_cast<Leaf*>(n);
+			int i = lower(l, key);
+			if (i == l->count || compare(key, l->keys[i])) return false;
+			std::move(l->keys + i + 1, l->keys + l->count, l->keys + i);
+			GC::move_range(l->values + i, l->values + i + 1, l->count - i - 1);
+			--l->count;
+			l->values[l->count] = (V*)collectable_null;
+			return true;
+		}
+		Inner* in = static_cast<Inner*>(n);
+		int i = upper(in, key);
+		if (!erase_from(in->child[i].get(), key)) return false;
+		Node* c = in->child[i].get();
+		if (c->count < min_count(c)) {
+			if (i > 0 && in->child[i - 1]->count > min_count(c)) borrow_left(in, i);
+			else if (i < in->count && in->child[i + 1]->count > min_count(c)) borrow_right(in, i);
+			else if (i > 0) merge(in, i - 1);
+			else merge(in, i);
+		}
+		return true;
+	}
+	bool erase(const K& key)
+	{
+		GC::safe_point();
+		if (!erase_from(root.get(), key)) return false;
+		--used;
+		if (!root->leaf && root->count == 0) root = static_cast<Inner*>(root.get())->child[0].get();
+		return true;
+	}
+
+	//Replaces the contents with n keys that are already sorted and unique, building the tree a level at a time
+	//instead of inserting.  Nodes are filled as evenly as possible, which keeps every one of them at least half full.
+	void bulk_load(const K* keys, const RootPtr<V>* values, int n)
+	{
+		GC::safe_point();
+		used = n;
+		if (n <= BTREE_NODE_KEYS) {
+			Leaf* l = new Leaf;
+			for (int k = 0; k < n; ++k) {
+				assert(k == 0 || compare(keys[k - 1], keys[k]));
+				l->keys[k] = keys[k];
+				l->values[k] = values[k];
+			}
+			l->count = n;
+			root = l;
+			return;
+		}
+		//the nodes of the level being built are rooted here until the level above holds them,
+		//the vectors are reserved and filled with emplace_back because moving a RootPtr isn't safe
+		std::vector<RootPtr<Node>> level;
+		std::vector<K> low;
+		int leaves = (n + BTREE_NODE_KEYS - 1) / BTREE_NODE_KEYS;
+		level.reserve(leaves);
+		low.reserve(leaves);
+		Leaf* prev = nullptr;
+		for (int j = 0; j < leaves; ++j) {
+			GC::safe_point();
+			int b = (int)((int64_t)j * n / leaves), e = (int)((int64_t)(j + 1) * n / leaves);
+			Leaf* l = new Leaf;
+			for (int k = b; k < e; ++k) {
+				assert(k == 0 || compare(keys[k - 1], keys[k]));
+				l->keys[k - b] = keys[k];
+				l->values[k - b] = values[k];
+			}
+			l->count = e - b;
+			if (prev != nullptr) prev->next = l;
+			prev = l;
+			level.emplace_back(l);
+			low.push_back(keys[b]);
+		}
+		while (level.size() > 1) {
+			int s = (int)level.size();
+			int nodes = (s + BTREE_NODE_KEYS) / (BTREE_NODE_KEYS + 1);
+			std::vector<RootPtr<Node>> up;
+			std::vector<K> up_low;
+			up.reserve(nodes);
+			up_low.reserve(nodes);
+			for (int j = 0; j < nodes; ++j) {
+				GC::safe_point();
+				int b = j * s / nodes, e = (j + 1) * s / nodes;
+				Inner* in = new Inner;
+				for (int c = b; c < e; ++c) {
+					in->child[c - b] = level[c].get();
+					if (c > b) in->keys[c - b - 1] = low[c];
+				}
+				in->count = e - b - 1;
+				up.emplace_back(in);
+				up_low.push_back(low[b]);
+			}
+			level.swap(up);
+			low.swap(up_low);
+		}
+		root = level[0].get();
+	}
+	void clear()
+	{
+		root = new Leaf;
+		used = 0;
+	}
+	int size() const { return used; }
+	bool empty() const { return used == 0; }
+
+	virtual int total_instance_vars() const { return 1; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return &root; }
+};
+
+
+/* A lock free ordered map for sharing between mutator threads, as a skip list.
+*
+It follows the design of Java's ConcurrentSkipListMap, because that only needs compare and swap on whole pointers and that's
+what InstancePtr::compare_exchange gives us.  The collector reclaims unlinked nodes, and since the links hold handles that
+aren't reused while anyone can still see them, there's no ABA problem to work around.
+
+The bottom level is an ordered list of nodes.  Erasing a key takes three steps that any thread can finish for another one:
+the node's value is swapped to null, a marker node is put after it so that nothing can be inserted behind it, then its
+predecessor is swung past both.  The levels above are separate index objects that are only used to find a starting point
+on the bottom level, so they're allowed to be a little out of date.
+
+Values can't be null, null is what marks an erased node.  Iterators are weakly consistent like Java's: they see every key
+that was there for the whole iteration and may or may not see ones that came or went during it.
+*/
+
+#define SKIPLIST_MAX_LEVEL 32
+
+template<typename K, typename V>
+struct SkipListNode :public Collectable
+{
+	enum Kind :uint8_t { Data, Marker, Header };
+	K key;
+	InstancePtr<V> value;
+	InstancePtr<SkipListNode<K, V>> next;
+	Kind kind;
+	SkipListNode(const K& k, V* v, SkipListNode<K, V>* n) :key(k), value(v), next(n), kind(Data) { log_size(sizeof(*this)); }
+	SkipListNode(Kind kd, SkipListNode<K, V>* n) :next(n), kind(kd) { log_size(sizeof(*this)); }
+	bool erased() const { return kind == Data && value.load(std::memory_order_acquire) == collectable_null; }
+	virtual int total_instance_vars() const { return 2; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { if (num == 0) return &value; return &next; }
+};
+
+template<typename K, typename V>
+struct SkipListIndex :public Collectable
+{
+	InstancePtr<SkipListNode<K, V>> node;
+	InstancePtr<SkipListIndex<K, V>> down;
+	InstancePtr<SkipListIndex<K, V>> right;
+	//only set in the head index of each level
+	int level;
+	SkipListIndex(SkipListNode<K, V>* n, SkipListIndex<K, V>* d, SkipListIndex<K, V>* r, int l) :node(n), down(d), right(r), level(l) { log_size(sizeof(*this)); }
+	virtual int total_instance_vars() const { return 3; }
+	virtual InstancePtrBase* index_into_instance_vars(int num)
+	{
+		if (num == 0) return &node;
+		if (num == 1) return &down;
+		return &right;
+	}
+};
+
+template<typename K, typename V, typename Compare = std::less<K>>
+struct ConcurrentCollectableSkipList :public Collectable
+{
+	typedef SkipListNode<K, V> Node;
+	typedef SkipListIndex<K, V> Index;
+
+	Compare compare;
+	std::atomic_int used;
+	InstancePtr<Index> head;
+
+	ConcurrentCollectableSkipList() :used(0), head(new Index(new Node(Node::Header, (Node*)collectable_null), (Index*)collectable_null, (Index*)collectable_null, 1)) { log_size(sizeof(*this)); }
+
+	struct iterator
+	{
+		RootPtr<Node> node;
+		RootPtr<V> val;
+		iterator() :node((Node*)collectable_null), val((V*)collectable_null) {}
+		iterator(Node* n) :node((Node*)collectable_null), val((V*)collectable_null) { settle(n); }
+		//declared so that iterators are never moved, see CollectableBTreeMap::iterator
+		iterator(const iterator& o) :node(o.node), val(o.val) {}
+		iterator& operator=(const iterator& o) { node = o.node; val = o.val; return *this; }
+		//stops at the first node from n on that still has a value, and keeps that value
+		void settle(Node* n)
+		{
+			for (; n != collectable_null; n = n->next.load(std::memory_order_acquire)) {
+				if (n->kind != Node::Data) continue;
+				V* v = n->value.load(std::memory_order_acquire);
+				if (v != collectable_null) {
+					node = n;
+					val = v;
+					return;
+				}
+			}
+			node = (Node*)collectable_null;
+			val = (V*)collectable_null;
+		}
+		bool operator==(const iterator& o) const { return node.get() == o.node.get(); }
+		bool operator!=(const iterator& o) const { return !(*this == o); }
+		iterator& operator++()
+		{
+			GC::safe_point();
+			settle(node->next.load(std::memory_order_acquire));
+			return *this;
+		}
+		const K& key() const { return node->key; }
+		RootPtr<V> value() const { return val; }
+	};
+
+	int cmp(const K& a, const K& b) const { return compare(a, b) ? -1 : compare(b, a) ? 1 : 0; }
+
+	static int random_level()
+	{
+		thread_local uint32_t x = 2463534242u ^ (uint32_t)GC::ThreadContext->thread_number * 0x9E3779B9u;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		//a quarter of the nodes get indexed, and each level up has a quarter as many again
+		uint32_t r = x;
+		int level = 0;
+		while ((r & 3) == 0 && level < SKIPLIST_MAX_LEVEL - 1) {
+			++level;
+			r = (r >> 2) | 0x80000000u;
+		}
+		return level;
+	}
+
+	//publishes new_succ between q and succ unless q's node is being erased
+	static bool link(Index* q, Index* succ, Index* new_succ)
+	{
+		new_succ->right = succ;
+		return !q->node->erased() && q->right.compare_exchange(succ, new_succ);
+	}
+	static bool unlink(Index* q, Index* succ)
+	{
+		return !q->node->erased() && q->right.compare_exchange(succ, succ->right.load(std::memory_order_acquire));
+	}
+	//n has been erased, take the next step of unlinking it from between b and f
+	static void help_erase(Node* n, Node* b, Node* f)
+	{
+		if (f == n->next.load(std::memory_order_acquire) && n == b->next.load(std::memory_order_acquire)) {
+			if (f == collectable_null || f->kind != Node::Marker) n->next.compare_exchange(f, new Node(Node::Marker, f));
+			else b->next.compare_exchange(n, f->next.load(std::memory_order_acquire));
+		}
+	}
+
+	//a bottom level node before key, unlinking erased index entries on the way down
+	Node* find_predecessor(const K& key)
+	{
+		for (;;) {
+			Index* q = head.load(std::memory_order_acquire);
+			Index* r = q->right.load(std::memory_order_acquire);
+			for (;;) {
+				if (r != collectable_null) {
+					Node* n = r->node.get();
+					if (n->erased()) {
+						if (!unlink(q, r)) break;
+						r = q->right.load(std::memory_order_acquire);
+						continue;
+					}
+					if (compare(n->key, key)) {
+						q = r;
+						r = r->right.load(std::memory_order_acquire);
+						continue;
+					}
+				}
+				Index* d = q->down.get();
+				if (d == collectable_null) return q->node.get();
+				q = d;
+				r = d->right.load(std::memory_order_acquire);
+			}
+		}
+	}
+	//the node holding key or nullptr, helping along any erases it runs into
+	Node* find_node(const K& key)
+	{
+		for (;;) {
+			Node* b = find_predecessor(key);
+			Node* n = b->next.load(std::memory_order_acquire);
+			for (;;) {
+				if (n == collectable_null) return nullptr;
+				Node* f = n->next.load(std::memory_order_acquire);
+				if (n != b->next.load(std::memory_order_acquire) || n->kind == Node::Marker || b->erased()) break;
+				if (n->erased()) {
+					help_erase(n, b, f);
+					break;
+				}
+				int c = cmp(key, n->key);
+				if (c == 0) return n;
+				if (c < 0) return nullptr;
+				b = n;
+				n = f;
+			}
+		}
+	}
+
+	bool contains(const K& key)
+	{
+		GC::safe_point();
+		return find_node(key) != nullptr;
+	}
+	RootPtr<V> operator[](const K& key)
+	{
+		GC::safe_point();
+		Node* n = find_node(key);
+		if (n == nullptr) return (V*)collectable_null;
+		return n->value.load(std::memory_order_acquire);
+	}
+
+	//links a new bottom level node for key, or returns nullptr if key was already there
+	Node* put_node(const K& key, V* value, bool only_if_absent)
+	{
+		for (;;) {
+			Node* b = find_predecessor(key);
+			Node* n = b->next.load(std::memory_order_acquire);
+			for (;;) {
+				if (n != collectable_null) {
+					Node* f = n->next.load(std::memory_order_acquire);
+					if (n != b->next.load(std::memory_order_acquire) || n->kind == Node::Marker || b->erased()) break;
+					V* v = n->value.load(std::memory_order_acquire);
+					if (v == collectable_null) {
+						help_erase(n, b, f);
+						break;
+					}
+					int c = cmp(key, n->key);
+					if (c > 0) {
+						b = n;
+						n = f;
+						continue;
+					}
+					if (c == 0) {
+						if (only_if_absent || n->value.compare_exchange(v, value)) return nullptr;
+						break;
+					}
+				}
+				Node* z = new Node(key, value, n);
+				if (b->next.compare_exchange(n, z)) return z;
+				break;
+			}
+		}
+	}
+	//gives z a tower of index entries, adding a level to the head if z is the first one that tall
+	void add_index(Node* z, const K& key)
+	{
+		int level = random_level();
+		if (level == 0) return;
+		Index* h = head.load(std::memory_order_acquire);
+		int max = h->level;
+		Index* idx = (Index*)collectable_null;
+		if (level <= max) {
+			for (int i = 1; i <= level; ++i) idx = new Index(z, idx, (Index*)collectable_null, 0);
+		}
+		else {
+			level = max + 1;
+			Index* idxs[SKIPLIST_MAX_LEVEL + 1];
+			for (int i = 1; i <= level; ++i) idxs[i] = idx = new Index(z, idx, (Index*)collectable_null, 0);
+			for (;;) {
+				h = head.load(std::memory_order_acquire);
+				int old_level = h->level;
+				if (level <= old_level) break;
+				Index* newh = h;
+				Node* base = h->node.get();
+				for (int j = old_level + 1; j <= level; ++j) newh = new Index(base, newh, idxs[j], j);
+				Index* expected = h;
+				if (head.compare_exchange(expected, newh)) {
+					h = newh;
+					idx = idxs[level = old_level];
+					break;
+				}
+			}
+		}
+		//link the tower in from the top down, starting over at the level that failed if anything changes under us
+		for (int insertion = level;;) {
+			int j = h->level;
+			Index* q = h;
+			Index* r = q->right.load(std::memory_order_acquire);
+			Index* t = idx;
+			for (;;) {
+				if (q == collectable_null || t == collectable_null) return;
+				if (r != collectable_null) {
+					Node* n = r->node.get();
+					int c = cmp(key, n->key);
+					if (n->erased()) {
+						if (!unlink(q, r)) break;
+						r = q->right.load(std::memory_order_acquire);
+						continue;
+					}
+					if (c > 0) {
+						q = r;
+						r = r->right.load(std::memory_order_acquire);
+						continue;
+					}
+				}
+				if (j == insertion) {
+					if (!link(q, r, t)) break;
+					if (t->node->erased()) {
+						find_node(key);
+						return;
+					}
+					if (--insertion == 0) return;
+				}
+				if (--j >= insertion && j < level) t = t->down.get();
+				q = q->down.get();
+				if (q == collectable_null) return;
+				r = q->right.load(std::memory_order_acquire);
+			}
+		}
+	}
+	//returns true if the key was new
+	bool put(const K& key, const RootPtr<V>& value, bool only_if_absent)
+	{
+		assert(value.get() != collectable_null);
+		GC::safe_point();
+		Node* z = put_node(key, value.get(), only_if_absent);
+		if (z == nullptr) return false;
+		++used;
+		add_index(z, key);
+		return true;
+	}
+	bool insert(const K& key, const RootPtr<V>& value) { return put(key, value, true); }
+	void insert_or_assign(const K& key, const RootPtr<V>& value) { put(key, value, false); }
+
+	bool erase(const K& key)
+	{
+		GC::safe_point();
+		for (;;) {
+			Node* b = find_predecessor(key);
+			Node* n = b->next.load(std::memory_order_acquire);
+			for (;;) {
+				if (n == collectable_null) return false;
+				Node* f = n->next.load(std::memory_order_acquire);
+				if (n != b->next.load(std::memory_order_acquire) || n->kind == Node::Marker || b->erased()) break;
+				V* v = n->value.load(std::memory_order_acquire);
+				if (v == collectable_null) {
+					help_erase(n, b, f);
+					break;
+				}
+				int c = cmp(key, n->key);
+				if (c < 0) return false;
+				if (c > 0) {
+					b = n;
+					n = f;
+					continue;
+				}
+				if (!n->value.compare_exchange(v, (V*)collectable_null)) break;
+				--used;
+				Node* next = f;
+				Node* node = n;
+				if (!n->next.compare_exchange(next, new Node(Node::Marker, f)) || !b->next.compare_exchange(node, f)) find_node(key);
+				else find_predecessor(key);
+				return true;
+			}
+		}
+	}
+
+	iterator begin()
+	{
+		GC::safe_point();
+		Index* h = head.load(std::memory_order_acquire);
+		return iterator(h->node->next.load(std::memory_order_acquire));
+	}
+	iterator end() { return iterator(); }
+	iterator lower_bound(const K& key)
+	{
+		GC::safe_point();
+		Node* n = find_predecessor(key);
+		while (n != collectable_null && (n->kind != Node::Data || compare(n->key, key))) n = n->next.load(std::memory_order_acquire);
+		return iterator(n);
+	}
+
+	//the count can be stale by the time it's returned if other threads are writing
+	int size() const { return used.load(std::memory_order_relaxed); }
+
+	virtual int total_instance_vars() const { return 1; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return &head; }
+};
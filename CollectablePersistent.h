@@ -0,0 +1,460 @@
+#pragma once
+#include "CollectableHash.h"
+
+
+/* Persistent collections, where an update leaves the version it was applied to alone and returns a new version.
+*
+The new version copies only the nodes on the path to the change and shares the rest with the old one, so an update costs
+O(log n) allocations, keeping an old version costs nothing, and a version can be handed to other threads as a consistent
+snapshot without copying.  Nodes are never written after they're published, so readers need no locks.  A version
+stores its root, and tail, with release once everything under them is written and readers load them with acquire, so
+the nodes a reader walks are complete even if the version reached it through a relaxed pointer.  Once no version
+refers to a node the collector frees it like anything else.
+
+PersistentVector is a 32 way trie of its elements with the last partial leaf kept apart as a tail, so push_back usually
+copies only the tail.  Elements are found by index, 5 bits to a level.
+
+PersistentHashMap is a hash array mapped trie.  Each node has a bitmap of which 5 bit hash pieces have a key stored right in
+the node and one of which have a child node, and keeps only the slots it's using.  Keys hash and compare with hash() and
+equal() like the other collectable keyed tables.  Keys whose hashes are equal in all 32 bits share a collision node.
+
+Every update starts with a safe point and makes no others, so the raw pointers it walks with stay good.  The versions and
+what they return should be held in RootPtrs.
+
+ */
+
+#define PERSISTENT_BITS 5
+#define PERSISTENT_WIDTH 32
+//past the last 5 bit piece of a 32 bit hash
+#define HAMT_COLLISION_SHIFT 35
+
+namespace Persistent {
+	inline int bit_count(uint32_t m)
+	{
+#ifdef _MSC_VER
+		return (int)__popcnt(m);
+#else
+		return __builtin_popcount(m);
+#endif
+	}
+}
+
+struct PersistentVectorNode final :public TriviallyFinalized<PersistentVectorNode, Collectable, InstancePtr<Collectable>>
+{
+	//the children, or the elements in a leaf
+	InstancePtr<Collectable> slot[PERSISTENT_WIDTH];
+	PersistentVectorNode() { log_size(sizeof(*this)); }
+	//a copy to change before publishing it
+	PersistentVectorNode(const PersistentVectorNode* o) { GC::copy_range(slot, o->slot, PERSISTENT_WIDTH); log_size(sizeof(*this)); }
+	virtual int total_instance_vars() const { return PERSISTENT_WIDTH; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return &slot[num]; }
+};
+
+template<typename T>
+struct PersistentVector :public Collectable
+{
+	typedef PersistentVectorNode Node;
+	typedef PersistentVector<T> Version;
+
+	int count;
+	//of the root's level
+	int shift;
+	InstancePtr<Node> root;
+	InstancePtr<Node> tail;
+
+	PersistentVector() :count(0), shift(PERSISTENT_BITS)
+	{
+		root.store(new Node, std::memory_order_release);
+		tail.store(new Node, std::memory_order_release);
+		log_size(sizeof(*this));
+	}
+	PersistentVector(int c, int s, Node* r, Node* t) :count(c), shift(s)
+	{
+		root.store(r, std::memory_order_release);
+		tail.store(t, std::memory_order_release);
+		log_size(sizeof(*this));
+	}
+	Node* root_node() const { return root.load(std::memory_order_acquire); }
+	Node* tail_node() const { return tail.load(std::memory_order_acquire); }
+
+	int size() const { return count; }
+	bool empty() const { return count == 0; }
+	//index of the first element in the tail
+	int tail_offset() const { return count < PERSISTENT_WIDTH ? 0 : ((count - 1) >> PERSISTENT_BITS) << PERSISTENT_BITS; }
+	Node* leaf_for(int i) const
+	{
+		Node* t = tail_node();
+		if (i >= tail_offset()) return t;
+		Node* n = root_node();
+		for (int level = shift; level > 0; level -= PERSISTENT_BITS) n = (Node*)n->slot[(i >> level) & (PERSISTENT_WIDTH - 1)].get();
+		return n;
+	}
+	//the element isn't rooted, it's only good until the next safe point unless this version is kept
+	T* getu(int i) const { return (T*)leaf_for(i)->slot[i & (PERSISTENT_WIDTH - 1)].get(); }
+	RootPtr<T> operator[](int i) const { return getu(i); }
+	RootPtr<T> at(int i) const
+	{
+		if (i < 0 || i >= count) throw std::out_of_range("PersistentVector index out of range");
+		return getu(i);
+	}
+
+	static Node* new_path(int level, Node* n)
+	{
+		for (; level > 0; level -= PERSISTENT_BITS) {
+			Node* p = new Node;
+			p->slot[0] = n;
+			n = p;
+		}
+		return n;
+	}
+	//copies the path to where the full tail goes as the new last leaf
+	Node* push_tail(int level, Node* parent, Node* leaf) const
+	{
+		int i = ((count - 1) >> level) & (PERSISTENT_WIDTH - 1);
+		Node* r = new Node(parent);
+		Node* insert;
+		if (level == PERSISTENT_BITS) insert = leaf;
+		else {
+			Node* child = (Node*)parent->slot[i].get();
+			insert = child != collectable_null ? push_tail(level - PERSISTENT_BITS, child, leaf) : new_path(level - PERSISTENT_BITS, leaf);
+		}
+		r->slot[i] = insert;
+		return r;
+	}
+	//copies the path to the last leaf without it, nullptr if that leaves the node empty
+	Node* pop_tail(int level, Node* n) const
+	{
+		int i = ((count - 2) >> level) & (PERSISTENT_WIDTH - 1);
+		if (level > PERSISTENT_BITS) {
+			Node* child = pop_tail(level - PERSISTENT_BITS, (Node*)n->slot[i].get());
+			if (child == nullptr && i == 0) return nullptr;
+			Node* r = new Node(n);
+			if (child == nullptr) r->slot[i] = collectable_null;
+			else r->slot[i] = child;
+			return r;
+		}
+		if (i == 0) return nullptr;
+		Node* r = new Node(n);
+		r->slot[i] = collectable_null;
+		return r;
+	}
+	static Node* set_in(int level, Node* n, int i, T* v)
+	{
+		Node* r = new Node(n);
+		if (level == 0) r->slot[i & (PERSISTENT_WIDTH - 1)] = v;
+		else {
+			int s = (i >> level) & (PERSISTENT_WIDTH - 1);
+			r->slot[s] = set_in(level - PERSISTENT_BITS, (Node*)n->slot[s].get(), i, v);
+		}
+		return r;
+	}
+
+	RootPtr<Version> push_back(const RootPtr<T>& v) const
+	{
+		GC::safe_point();
+		int t = count - tail_offset();
+		if (t < PERSISTENT_WIDTH) {
+			Node* nt = new Node(tail_node());
+			nt->slot[t] = v.get();
+			return new Version(count + 1, shift, root_node(), nt);
+		}
+		Node* nr;
+		int ns = shift;
+		//the root is full, grow a level
+		if ((count >> PERSISTENT_BITS) > (1 << shift)) {
+			nr = new Node;
+			nr->slot[0] = root_node();
+			nr->slot[1] = new_path(shift, tail_node());
+			ns += PERSISTENT_BITS;
+		}
+		else nr = push_tail(shift, root_node(), tail_node());
+		Node* nt = new Node;
+		nt->slot[0] = v.get();
+		return new Version(count + 1, ns, nr, nt);
+	}
+	RootPtr<Version> set(int i, const RootPtr<T>& v) const
+	{
+		if (i < 0 || i >= count) throw std::out_of_range("PersistentVector index out of range");
+		GC::safe_point();
+		if (i >= tail_offset()) {
+			Node* nt = new Node(tail_node());
+			nt->slot[i & (PERSISTENT_WIDTH - 1)] = v.get();
+			return new Version(count, shift, root_node(), nt);
+		}
+		return new Version(count, shift, set_in(shift, root_node(), i, v.get()), tail_node());
+	}
+	//an empty vector returns itself
+	RootPtr<Version> pop_back() const
+	{
+		if (count == 0) return const_cast<Version*>(this);
+		GC::safe_point();
+		if (count == 1) return new Version;
+		int t = count - tail_offset();
+		if (t > 1) {
+			Node* nt = new Node(tail_node());
+			nt->slot[t - 1] = collectable_null;
+			return new Version(count - 1, shift, root_node(), nt);
+		}
+		//the last leaf in the tree becomes the tail
+		Node* nt = leaf_for(count - 2);
+		Node* nr = pop_tail(shift, root_node());
+		int ns = shift;
+		if (nr == nullptr) nr = new Node;
+		if (shift > PERSISTENT_BITS && nr->slot[1].get() == collectable_null) {
+			nr = (Node*)nr->slot[0].get();
+			ns -= PERSISTENT_BITS;
+		}
+		return new Version(count - 1, ns, nr, nt);
+	}
+
+	//calls f(T*) on each element in order, with a safe point between leaves.  the version has to be rooted
+	template <typename F>
+	void for_each(F f) const
+	{
+		for (int i = 0; i < count; i += PERSISTENT_WIDTH) {
+			GC::safe_point();
+			Node* leaf = leaf_for(i);
+			int n = count - i < PERSISTENT_WIDTH ? count - i : PERSISTENT_WIDTH;
+			for (int j = 0; j < n; ++j) f((T*)leaf->slot[j].get());
+		}
+	}
+
+	virtual int total_instance_vars() const { return 2; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { if (num == 0) return &root; return &tail; }
+};
+
+struct HamtNode :public CollectableSized<HamtNode, InstancePtr<Collectable>>
+{
+	//bit i of datamap is set if a key with hash piece i is stored in this node, of nodemap if there's a child for piece i
+	uint32_t datamap;
+	uint32_t nodemap;
+	//s is the number of slots, from make_sized
+	HamtNode(int s, uint32_t d, uint32_t n) :CollectableSized<HamtNode, InstancePtr<Collectable>>(s), datamap(d), nodemap(n) { log_size(sizeof(*this)); }
+	static HamtNode* make(uint32_t d, uint32_t n, int s) { return GC::make_sized<HamtNode>(s, d, n); }
+	int size() const { return trailing_size(); }
+	//the key, value pairs in bit order, then the children in bit order.  a collision node has no maps, just pairs
+	InstancePtr<Collectable>* slot() { return trailing(); }
+	const InstancePtr<Collectable>* slot() const { return trailing(); }
+	int data_index(uint32_t bit) const { return 2 * Persistent::bit_count(datamap & (bit - 1)); }
+	int node_index(uint32_t bit) const { return 2 * Persistent::bit_count(datamap) + Persistent::bit_count(nodemap & (bit - 1)); }
+};
+
+template<typename K, typename V>
+struct PersistentHashMap :public Collectable
+{
+	typedef HamtNode Node;
+	typedef PersistentHashMap<K, V> Version;
+
+	int count;
+	InstancePtr<Node> root;
+
+	PersistentHashMap() :count(0)
+	{
+		root.store(Node::make(0, 0, 0), std::memory_order_release);
+		log_size(sizeof(*this));
+	}
+	PersistentHashMap(int c, Node* r) :count(c)
+	{
+		root.store(r, std::memory_order_release);
+		log_size(sizeof(*this));
+	}
+	Node* root_node() const { return root.load(std::memory_order_acquire); }
+
+	static uint32_t hash_of(const K* k) { return SwissHash::mix(k->hash()); }
+	static uint32_t bit_of(uint32_t h, int shift) { return 1u << ((h >> shift) & (PERSISTENT_WIDTH - 1)); }
+
+	static Node* clone(const Node* n)
+	{
+		Node* r = Node::make(n->datamap, n->nodemap, n->size());
+		GC::copy_range(r->slot(), n->slot(), n->size());
+		return r;
+	}
+	//the value or nullptr
+	static V* find_in(Node* n, uint32_t h, int shift, K* key)
+	{
+		for (;; shift += PERSISTENT_BITS) {
+			if (shift >= HAMT_COLLISION_SHIFT) {
+				for (int i = 0; i < n->size(); i += 2) if (((K*)n->slot()[i].get())->equal(key)) return (V*)n->slot()[i + 1].get();
+				return nullptr;
+			}
+			uint32_t bit = bit_of(h, shift);
+			if (n->datamap & bit) {
+				int i = n->data_index(bit);
+				return ((K*)n->slot()[i].get())->equal(key) ? (V*)n->slot()[i + 1].get() : nullptr;
+			}
+			if (!(n->nodemap & bit)) return nullptr;
+			n = (Node*)n->slot()[n->node_index(bit)].get();
+		}
+	}
+	//a node holding just the two pairs, nested as deep as it takes for their hash pieces to differ
+	static Node* pair_node(K* k1, V* v1, uint32_t h1, K* k2, V* v2, uint32_t h2, int shift)
+	{
+		if (shift >= HAMT_COLLISION_SHIFT) {
+			Node* r = Node::make(0, 0, 4);
+			r->slot()[0] = k1;
+			r->slot()[1] = v1;
+			r->slot()[2] = k2;
+			r->slot()[3] = v2;
+			return r;
+		}
+		uint32_t b1 = bit_of(h1, shift), b2 = bit_of(h2, shift);
+		if (b1 == b2) {
+			Node* r = Node::make(0, b1, 1);
+			r->slot()[0] = pair_node(k1, v1, h1, k2, v2, h2, shift + PERSISTENT_BITS);
+			return r;
+		}
+		Node* r = Node::make(b1 | b2, 0, 4);
+		int a = b1 < b2 ? 0 : 2;
+		r->slot()[a] = k1;
+		r->slot()[a + 1] = v1;
+		r->slot()[2 - a] = k2;
+		r->slot()[3 - a] = v2;
+		return r;
+	}
+	static Node* assoc_in(Node* n, uint32_t h, int shift, K* key, V* value, bool& added)
+	{
+		if (shift >= HAMT_COLLISION_SHIFT) {
+			for (int i = 0; i < n->size(); i += 2) {
+				if (((K*)n->slot()[i].get())->equal(key)) {
+					Node* r = clone(n);
+					r->slot()[i + 1] = value;
+					return r;
+				}
+			}
+			Node* r = Node::make(0, 0, n->size() + 2);
+			GC::copy_range(r->slot(), n->slot(), n->size());
+			r->slot()[n->size()] = key;
+			r->slot()[n->size() + 1] = value;
+			added = true;
+			return r;
+		}
+		uint32_t bit = bit_of(h, shift);
+		if (n->datamap & bit) {
+			int i = n->data_index(bit);
+			K* k = (K*)n->slot()[i].get();
+			if (k->equal(key)) {
+				Node* r = clone(n);
+				r->slot()[i + 1] = value;
+				return r;
+			}
+			//the pair moves down into a new child along with the new one
+			Node* child = pair_node(k, (V*)n->slot()[i + 1].get(), hash_of(k), key, value, h, shift + PERSISTENT_BITS);
+			int ni = n->node_index(bit);
+			Node* r = Node::make(n->datamap ^ bit, n->nodemap | bit, n->size() - 1);
+			GC::copy_range(r->slot(), n->slot(), i);
+			GC::copy_range(r->slot() + i, n->slot() + i + 2, ni - i - 2);
+			r->slot()[ni - 2] = child;
+			GC::copy_range(r->slot() + ni - 1, n->slot() + ni, n->size() - ni);
+			added = true;
+			return r;
+		}
+		if (n->nodemap & bit) {
+			int i = n->node_index(bit);
+			Node* r = clone(n);
+			r->slot()[i] = assoc_in((Node*)n->slot()[i].get(), h, shift + PERSISTENT_BITS, key, value, added);
+			return r;
+		}
+		Node* r = Node::make(n->datamap | bit, n->nodemap, n->size() + 2);
+		int i = r->data_index(bit);
+		GC::copy_range(r->slot(), n->slot(), i);
+		r->slot()[i] = key;
+		r->slot()[i + 1] = value;
+		GC::copy_range(r->slot() + i + 2, n->slot() + i, n->size() - i);
+		added = true;
+		return r;
+	}
+	//returns n itself if key isn't there
+	static Node* dissoc_in(Node* n, uint32_t h, int shift, K* key)
+	{
+		if (shift >= HAMT_COLLISION_SHIFT) {
+			for (int i = 0; i < n->size(); i += 2) {
+				if (((K*)n->slot()[i].get())->equal(key)) {
+					Node* r = Node::make(0, 0, n->size() - 2);
+					GC::copy_range(r->slot(), n->slot(), i);
+					GC::copy_range(r->slot() + i, n->slot() + i + 2, n->size() - i - 2);
+					return r;
+				}
+			}
+			return n;
+		}
+		uint32_t bit = bit_of(h, shift);
+		if (n->datamap & bit) {
+			int i = n->data_index(bit);
+			if (!((K*)n->slot()[i].get())->equal(key)) return n;
+			Node* r = Node::make(n->datamap ^ bit, n->nodemap, n->size() - 2);
+			GC::copy_range(r->slot(), n->slot(), i);
+			GC::copy_range(r->slot() + i, n->slot() + i + 2, n->size() - i - 2);
+			return r;
+		}
+		if (!(n->nodemap & bit)) return n;
+		int i = n->node_index(bit);
+		Node* child = (Node*)n->slot()[i].get();
+		Node* c = dissoc_in(child, h, shift + PERSISTENT_BITS, key);
+		if (c == child) return n;
+		//a child down to one pair is folded back into this node, so the trie stays as shallow as it can
+		if (c->nodemap == 0 && c->size() == 2) {
+			Node* r = Node::make(n->datamap | bit, n->nodemap ^ bit, n->size() + 1);
+			int d = r->data_index(bit);
+			GC::copy_range(r->slot(), n->slot(), d);
+			r->slot()[d] = c->slot()[0].get();
+			r->slot()[d + 1] = c->slot()[1].get();
+			GC::copy_range(r->slot() + d + 2, n->slot() + d, i - d);
+			GC::copy_range(r->slot() + i + 2, n->slot() + i + 1, n->size() - i - 1);
+			return r;
+		}
+		Node* r = clone(n);
+		r->slot()[i] = c;
+		return r;
+	}
+
+	int size() const { return count; }
+	bool empty() const { return count == 0; }
+	//the value isn't rooted, it's only good until the next safe point unless this version is kept
+	V* findu(const RootPtr<K>& key) const
+	{
+		V* v = find_in(root_node(), hash_of(key.get()), 0, key.get());
+		return v == nullptr ? (V*)collectable_null : v;
+	}
+	bool contains(const RootPtr<K>& key) const
+	{
+		GC::safe_point();
+		return find_in(root_node(), hash_of(key.get()), 0, key.get()) != nullptr;
+	}
+	RootPtr<V> operator[](const RootPtr<K>& key) const
+	{
+		GC::safe_point();
+		return findu(key);
+	}
+	//a version with key mapped to value
+	RootPtr<Version> with(const RootPtr<K>& key, const RootPtr<V>& value) const
+	{
+		GC::safe_point();
+		bool added = false;
+		Node* r = assoc_in(root_node(), hash_of(key.get()), 0, key.get(), value.get(), added);
+		return new Version(added ? count + 1 : count, r);
+	}
+	//a version without key, or this one if key isn't in it
+	RootPtr<Version> without(const RootPtr<K>& key) const
+	{
+		GC::safe_point();
+		Node* r = dissoc_in(root_node(), hash_of(key.get()), 0, key.get());
+		if (r == root_node()) return const_cast<Version*>(this);
+		return new Version(count - 1, r);
+	}
+
+	//calls f(K*, V*) on each pair, in no particular order, with a safe point before each node.  the version has to be rooted
+	template <typename F>
+	void for_each(F f) const { for_each_in(root_node(), f); }
+	template <typename F>
+	static void for_each_in(Node* n, F& f)
+	{
+		GC::safe_point();
+		int d = 2 * Persistent::bit_count(n->datamap);
+		if (n->datamap == 0 && n->nodemap == 0) d = n->size();
+		for (int i = 0; i < d; i += 2) f((K*)n->slot()[i].get(), (V*)n->slot()[i + 1].get());
+		for (int i = d; i < n->size(); ++i) for_each_in((Node*)n->slot()[i].get(), f);
+	}
+
+	virtual int total_instance_vars() const { return 1; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return &root; }
+};
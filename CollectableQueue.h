@@ -0,0 +1,341 @@
+#pragma once
+#include "Collectable.h"
+
+
+/* A lock free multi producer, multi consumer FIFO of collectables.
+*
+The queue is a linked list of segments, each an array of QUEUE_SEGMENT_SIZE InstancePtr slots with its own enqueue and
+dequeue counters.  A producer claims a slot with one fetch_add on the tail segment's counter and fills it with a compare and
+swap, a consumer claims one with a fetch_add on the head segment's and takes what's in it with an exchange.  If a consumer
+gets to a slot before its producer does it marks the slot used, the producer's compare and swap fails and it claims another
+slot.  When a segment fills up a new one is linked after it, the old ones are garbage once the consumers have moved on.
+
+Nothing is allocated per element, the slots are traced by the collector like any other InstancePtr and the batch versions
+claim a run of slots with a single fetch_add.
+
+Constructed with a capacity the queue is bounded and enqueue fails when it's full, with 0 it grows without limit.
+Null can't be queued.
+
+ */
+
+#define QUEUE_SEGMENT_SIZE 1024
+
+template<typename T>
+struct QueueSegment :public Collectable
+{
+	std::atomic_int enqueue_index;
+	std::atomic_int dequeue_index;
+	InstancePtr<T> items[QUEUE_SEGMENT_SIZE];
+	InstancePtr<QueueSegment<T>> next;
+	QueueSegment() :enqueue_index(0), dequeue_index(0) { log_size(sizeof(*this)); }
+	virtual int total_instance_vars() const { return QUEUE_SEGMENT_SIZE + 1; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { if (num == QUEUE_SEGMENT_SIZE) return &next; return &items[num]; }
+};
+
+template<typename T>
+struct CollectableMPMCQueue :public Collectable
+{
+	typedef QueueSegment<T> Segment;
+
+	int capacity;
+	//only kept up when bounded
+	std::atomic_int count;
+	InstancePtr<Segment> head;
+	InstancePtr<Segment> tail;
+
+	CollectableMPMCQueue(int cap = 0) :capacity(cap), count(0)
+	{
+		Segment* s = new Segment;
+		head = s;
+		tail = s;
+		log_size(sizeof(*this));
+	}
+
+	//used slots point back at the queue, which can never be an item
+	T* used_slot() const { return (T*)(Collectable*)this; }
+
+	//returns how many of n more items fit, and reserves room for them
+	int reserve(int n)
+	{
+		if (capacity == 0) return n;
+		int c = count.fetch_add(n);
+		int over = c + n - capacity;
+		if (over <= 0) return n;
+		if (over > n) over = n;
+		count -= over;
+		return n - over;
+	}
+	//t is full, make sure there's a segment after it and that tail has moved on from it
+	void advance_tail(Segment* t)
+	{
+		if (t != tail.load(std::memory_order_acquire)) return;
+		Segment* next = t->next.load(std::memory_order_acquire);
+		if (next == collectable_null) {
+			Segment* s = new Segment;
+			if (t->next.compare_exchange(next, s)) next = s;
+		}
+		tail.compare_exchange(t, next);
+	}
+	//the next item or nullptr if the queue looks empty, the item isn't rooted so it has to be stored before the next safe point
+	T* take()
+	{
+		for (;;) {
+			Segment* h = head.load(std::memory_order_acquire);
+			int d = h->dequeue_index.load(std::memory_order_acquire);
+			if (d >= h->enqueue_index.load(std::memory_order_acquire) && h->next.load(std::memory_order_acquire) == collectable_null) return nullptr;
+			int idx = h->dequeue_index.fetch_add(1);
+			if (idx >= QUEUE_SEGMENT_SIZE) {
+				Segment* next = h->next.load(std::memory_order_acquire);
+				if (next == collectable_null) return nullptr;
+				head.compare_exchange(h, next);
+				continue;
+			}
+			T* v = h->items[idx].exchange(used_slot());
+			if (v != collectable_null) return v;
+		}
+	}
+
+	bool enqueue(const RootPtr<T>& item) { return enqueue_many(&item, 1) == 1; }
+	//Enqueues items in order until the queue is full and returns how many went in.
+	//U can be anything with a get() that gives a T*, RootPtr<T> or InstancePtr<T>.
+	template <typename U>
+	int enqueue_many(const U* items, int n)
+	{
+		GC::safe_point();
+		int k = reserve(n);
+		int done = 0;
+		while (done < k) {
+			Segment* t = tail.load(std::memory_order_acquire);
+			int idx = t->enqueue_index.fetch_add(k - done);
+			if (idx >= QUEUE_SEGMENT_SIZE) {
+				advance_tail(t);
+				continue;
+			}
+			int end = idx + k - done < QUEUE_SEGMENT_SIZE ? idx + k - done : QUEUE_SEGMENT_SIZE;
+			//a slot a consumer already marked used is skipped and its item goes in the next one
+			for (int i = idx; i < end; ++i) {
+				T* expected = (T*)collectable_null;
+				assert(items[done].get() != collectable_null);
+				if (t->items[i].compare_exchange(expected, items[done].get(), std::memory_order_release)) ++done;
+			}
+		}
+		return k;
+	}
+
+	//U is RootPtr<T> or InstancePtr<T>
+	template <typename U>
+	bool dequeue(U& out) { return dequeue_many(&out, 1) == 1; }
+	//dequeues up to max items into out and returns how many there were
+	template <typename U>
+	int dequeue_many(U* out, int max)
+	{
+		GC::safe_point();
+		int got = 0;
+		while (got < max) {
+			Segment* h = head.load(std::memory_order_acquire);
+			int d = h->dequeue_index.load(std::memory_order_acquire);
+			int e = h->enqueue_index.load(std::memory_order_acquire);
+			if (e > QUEUE_SEGMENT_SIZE) e = QUEUE_SEGMENT_SIZE;
+			if (d >= e) {
+				//nothing claimed past the consumers in this segment, take() sorts out moving to the next one
+				T* v = take();
+				if (v == nullptr) break;
+				out[got++] = v;
+				continue;
+			}
+			int want = e - d < max - got ? e - d : max - got;
+			int idx = h->dequeue_index.fetch_add(want);
+			int end = idx + want < QUEUE_SEGMENT_SIZE ? idx + want : QUEUE_SEGMENT_SIZE;
+			for (int i = idx; i < end; ++i) {
+				T* v = h->items[i].exchange(used_slot(), std::memory_order_acquire);
+				if (v != collectable_null) out[got++] = v;
+			}
+		}
+		if (capacity != 0 && got > 0) count -= got;
+		return got;
+	}
+
+	//can be stale by the time it's returned if other threads are using the queue
+	bool empty() const
+	{
+		Segment* h = head.load(std::memory_order_acquire);
+		int d = h->dequeue_index.load(std::memory_order_acquire);
+		return (d >= QUEUE_SEGMENT_SIZE || d >= h->enqueue_index.load(std::memory_order_acquire)) && h->next.load(std::memory_order_acquire) == collectable_null;
+	}
+	//only counted when the queue is bounded
+	int size() const { assert(capacity != 0); return count.load(std::memory_order_relaxed); }
+
+	virtual int total_instance_vars() const { return 2; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { if (num == 0) return &head; return &tail; }
+};
+
+
+/* A double ended queue of collectables with amortized O(1) pushes and pops at both ends and O(1) random access.
+*
+Elements live in blocks of DEQUE_BLOCK_SIZE InstancePtr slots and a map holds the blocks in a circle, so the deque can
+move through the map in either direction without shifting anything.  Blocks are only made when the deque first reaches them
+and stay in the map for reuse after they empty.  When the map is one block short of full it's doubled, which only copies
+block pointers, never elements.
+
+chunk and for_each_chunk hand out the elements a block at a time so loops over a deque don't pay for the index arithmetic
+on every element.
+
+Like CollectableVector it isn't safe to use from more than one thread at a time.
+
+ */
+
+#define DEQUE_BLOCK_SIZE 64
+#define DEQUE_INITIAL_BLOCKS 4
+
+template<typename T>
+struct DequeBlock final :public TriviallyFinalized<DequeBlock<T>, Collectable, InstancePtr<T>>
+{
+	InstancePtr<T> items[DEQUE_BLOCK_SIZE];
+	DequeBlock() { this->log_size(sizeof(*this)); }
+	virtual int total_instance_vars() const { return DEQUE_BLOCK_SIZE; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return &items[num]; }
+};
+
+template<typename T>
+struct DequeMap :public CollectableSized<DequeMap<T>, InstancePtr<DequeBlock<T>>>
+{
+	explicit DequeMap(int s) :CollectableSized<DequeMap<T>, InstancePtr<DequeBlock<T>>>(s) { this->log_size(sizeof(*this)); }
+	static DequeMap* make(int s) { return GC::make_sized<DequeMap>(s); }
+	//always a power of 2
+	int size() const { return this->trailing_size(); }
+	InstancePtr<DequeBlock<T>>& block(int i) { return this->trailing()[i]; }
+};
+
+template<typename T>
+struct CollectableDeque :public Collectable
+{
+	typedef DequeBlock<T> Block;
+	typedef DequeMap<T> Map;
+
+	InstancePtr<Map> map;
+	//slot of the front element, counting through the map's blocks
+	int first;
+	int count;
+
+	CollectableDeque() :first(0), count(0)
+	{
+		map = Map::make(DEQUE_INITIAL_BLOCKS);
+		log_size(sizeof(*this));
+	}
+
+	int mask() const { return map->size() * DEQUE_BLOCK_SIZE - 1; }
+	//where the element at i goes, its block has to exist
+	InstancePtr<T>& slot(int i) const
+	{
+		int p = (first + i) & mask();
+		return map->block(p / DEQUE_BLOCK_SIZE)->items[p & (DEQUE_BLOCK_SIZE - 1)];
+	}
+	InstancePtr<T>& insure_slot(int i)
+	{
+		int p = (first + i) & mask();
+		Block* b = map->block(p / DEQUE_BLOCK_SIZE).get();
+		if (b == collectable_null) {
+			b = new Block;
+			map->block(p / DEQUE_BLOCK_SIZE) = b;
+		}
+		return b->items[p & (DEQUE_BLOCK_SIZE - 1)];
+	}
+	//keeping a whole block free means the front and the back are never in the same block, so the blocks can be
+	//copied to the new map in order starting from the front's
+	void insure_room()
+	{
+		int n = map->size();
+		if (count < (n - 1) * DEQUE_BLOCK_SIZE) return;
+		RootPtr<Map> m = Map::make(n * 2);
+		int b = first / DEQUE_BLOCK_SIZE;
+		for (int j = 0; j < n; ++j) {
+			if ((j & 1023) == 1023) GC::safe_point();
+			m->block(j) = map->block((b + j) & (n - 1)).get();
+		}
+		first &= DEQUE_BLOCK_SIZE - 1;
+		map = m;
+	}
+
+	void push_back(const RootPtr<T>& o)
+	{
+		insure_room();
+		insure_slot(count) = o;
+		++count;
+	}
+	void push_front(const RootPtr<T>& o)
+	{
+		insure_room();
+		first = (first - 1) & mask();
+		insure_slot(0) = o;
+		++count;
+	}
+	//U is RootPtr<T> or InstancePtr<T>
+	template <typename U>
+	bool pop_back(U& o)
+	{
+		if (count == 0) return false;
+		InstancePtr<T>& s = slot(count - 1);
+		o = s.get();
+		s = (T*)collectable_null;
+		--count;
+		return true;
+	}
+	template <typename U>
+	bool pop_front(U& o)
+	{
+		if (count == 0) return false;
+		InstancePtr<T>& s = slot(0);
+		o = s.get();
+		s = (T*)collectable_null;
+		first = (first + 1) & mask();
+		--count;
+		return true;
+	}
+
+	int size() const { return count; }
+	bool empty() const { return count == 0; }
+	InstancePtr<T>& operator[](int i) { return slot(i); }
+	InstancePtr<T>& at(int i)
+	{
+		if (i < 0 || i >= count) throw std::out_of_range("CollectableDeque index out of range");
+		return slot(i);
+	}
+	InstancePtr<T>& front() { return at(0); }
+	InstancePtr<T>& back() { return at(count - 1); }
+	//drops the whole map, the old blocks are garbage
+	void clear()
+	{
+		map = Map::make(DEQUE_INITIAL_BLOCKS);
+		first = 0;
+		count = 0;
+	}
+
+	//the elements from i that are next to each other in memory, n gets how many, up to the end of i's block.
+	//only good until the next safe point or change to the deque
+	InstancePtr<T>* chunk(int i, int& n) const
+	{
+		assert(i >= 0 && i < count);
+		int p = (first + i) & mask();
+		int o = p & (DEQUE_BLOCK_SIZE - 1);
+		n = DEQUE_BLOCK_SIZE - o;
+		if (n > count - i) n = count - i;
+		return &map->block(p / DEQUE_BLOCK_SIZE)->items[o];
+	}
+	//calls f(InstancePtr<T>* items, int n) on each run of elements in [from, to) with a safe point between runs.
+	//f mustn't change the size of the deque
+	template <typename F>
+	void for_each_chunk(int from, int to, F f)
+	{
+		while (from < to) {
+			GC::safe_point();
+			int n;
+			InstancePtr<T>* items = chunk(from, n);
+			if (n > to - from) n = to - from;
+			f(items, n);
+			from += n;
+		}
+	}
+
+	virtual int total_instance_vars() const { return 1; }
+	virtual InstancePtrBase* index_into_instance_vars(int num) { return &map; }
+};
@@ -1,6 +1,8 @@
 #include <iostream>
 #include "Collectable.h"
 #include <cassert>
+#include <vector>
+#include <stdexcept>
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN 
 #include <Windows.h>
@@ -8,6 +10,10 @@
 #else
 #include <sched.h>
 #endif
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define RANGE_SSE2
+#endif
 
 /*
 Phase diagram
@@ -96,7 +102,7 @@ namespace GC {
     //holds the current state of the gc.
     //A union type so that it can be loaded, stored, compared atomically (always in memory_order_seq_cst)
     //holds the phase NOT_COLLECTING, COLLECTING, or RESTORING_SNAPSHOT,
-    //the phase type also has a phase that's only meant to be stored in a thread's own state "ThreadState" (which mirrors this).
+    //the phase type also has a phase that's only meant to be stored in a thread's own state "ThreadContext->phase" (which mirrors this).
     //NOT_MUTATING is the state of a thread that has opted out of mutation 
     //There is also an EXIT state for exitting the program but it isn't used.  Instead "exit_program_flag" is used to tell programs not to 
     //bother syncing with the gc anymore, the program is ending.
@@ -144,17 +150,13 @@ namespace GC {
     int64_t MaxTriggerPoint;
     std::atomic_int64_t TriggerPoint;
     std::atomic_int64_t Allocated;
-    thread_local int64_t ThreadAllocated;
-    thread_local int AggregateLogAlloc;
-    thread_local int AggregateArrayLogAlloc;
 
     std::atomic_bool single_thread_event = false;
 
-    thread_local void (*write_barrier)(SnapPtr*, Handle);
-
-    thread_local PhaseEnum ThreadState;
-    thread_local int NotMutatingCount;
-    thread_local int MyThreadNumber;
+    MutatorContext MutatorContexts[MAX_COLLECTED_THREADS];
+    thread_local MutatorContext* ThreadContext = &MutatorContexts[0];
+    //zero initialized, so its phase is NOT_MUTATING from the start
+    MutatorContext FinalizerContext;
     //there is a bug in the handling of CombinedThread.  Some places assuming it's visible across threads some assuming it isn't
     // for now it only works in a single threaded program
     //thread_local 
@@ -163,18 +165,18 @@ namespace GC {
     std::thread CollectionThread;
 
     void one_collect();
-    thread_local int HandlesUsedThread = 0;
 
-    void alloc_merge()
+    //the slow path of log_alloc(), also run whenever a thread exits.
+    void alloc_merge(MutatorContext* ctx)
     {
-        HandlesUsedThread += AggregateLogAlloc<<1;
-        AggregateLogAlloc = 0;
-        Allocated += ThreadAllocated;
-        ThreadAllocated = 0;
-        if (Allocated > TriggerPoint || HandlesUsedThread > HandlesPerBlock * 1024) {
+        ctx->handles_used += ctx->aggregate_log_alloc<<1;
+        ctx->aggregate_log_alloc = 0;
+        Allocated += ctx->allocated;
+        ctx->allocated = 0;
+        if (Allocated > TriggerPoint || ctx->handles_used > HandlesPerBlock * 1024) {
             int temp = Allocated.exchange(0);
-            if (temp > TriggerPoint || HandlesUsedThread > HandlesPerBlock * 1024) {
-                HandlesUsedThread = 0;
+            if (temp > TriggerPoint || ctx->handles_used > HandlesPerBlock * 1024) {
+                ctx->handles_used = 0;
                 if (CombinedThread) single_thread_event = true;
                 else SendCollectionEvent();
             }
@@ -183,22 +185,14 @@ namespace GC {
 
     }
 
-    //Once every 300 allocations within a thread or for every allocation over 500,000 bytes, it checks how much was allocated by all threads and triggers a garbage collect if it was beyond a threshold
-    //Note that alloc merge does this whenever a thread exits as well.
-    void log_alloc(size_t a)
-    {
-        ThreadAllocated += a;
-        if (++AggregateLogAlloc > 300 || a > 500000) {
-            alloc_merge();
-        }
-    }
     void log_array_alloc(size_t a, size_t n)
     {
-        ThreadAllocated += a + n;
-        if (++AggregateArrayLogAlloc > 20) {
-            AggregateArrayLogAlloc = 0;
-            Allocated += ThreadAllocated;
-            ThreadAllocated = 0;
+        MutatorContext* ctx = ThreadContext;
+        ctx->allocated += a + n;
+        if (++ctx->aggregate_array_log_alloc > 20) {
+            ctx->aggregate_array_log_alloc = 0;
+            Allocated += ctx->allocated;
+            ctx->allocated = 0;
             if (Allocated > TriggerPoint) {
                 if (Allocated.exchange(0) > TriggerPoint) {
                     if (CombinedThread) single_thread_event = true;
@@ -209,25 +203,144 @@ namespace GC {
     }
 
 
-    void regular_write_barrier(SnapPtr* dest, Handle v) {
-        assert(ThreadState != PhaseEnum::NOT_MUTATING);
-        assert(ThreadState != PhaseEnum::COLLECTING);
-        double_ptr_store(dest, v);
+    void request_collection()
+    {
+        if (CombinedThread) single_thread_event = true;
+        else SendCollectionEvent();
     }
-    void collecting_write_barrier(SnapPtr* dest, Handle v) {
-        assert(ThreadState != PhaseEnum::NOT_MUTATING);
-        assert(ThreadState == PhaseEnum::COLLECTING);
-        single_ptr_store(dest, v);
+
+    Handle current_fresh_tag()
+    {
+        return FreshTag | (ActiveIndex ? FreshEpochBit : 0);
     }
 
+    void SetThreadState(MutatorContext* ctx, PhaseEnum v) {
+        ctx->phase = v;
+        if (v == PhaseEnum::COLLECTING) ctx->fresh_tag = current_fresh_tag();
+    }
     void SetThreadState(PhaseEnum v) {
-        ThreadState = v;
-        if (v == PhaseEnum::COLLECTING) {
-            write_barrier = collecting_write_barrier;
+        SetThreadState(ThreadContext, v);
+    }
+
+
+    void frozen_store()
+    {
+        throw std::logic_error("store into a pointer of a frozen collectable");
+    }
+
+    //Bulk stores over contiguous SnapPtrs.  Each chunk is stored with the barrier of the phase the thread is in when the
+    //chunk starts, and there is a safe point between chunks so a long copy can't hold up a collection.
+
+    //both halves of every destination get the current half of the source.  With SSE2 two pointers are loaded at once,
+    //the current halves are duplicated into the snapshot halves and each 64 bit lane is stored separately, so every
+    //SnapPtr is still written by one atomic 64 bit store.  A pair is loaded before either of its slots is stored, so
+    //this also works for overlapping ranges as long as the direction is right.
+    static void double_copy_forward(SnapPtr* dest, const SnapPtr* src, size_t n)
+    {
+        size_t i = 0;
+#ifdef RANGE_SSE2
+        for (; i + 2 <= n; i += 2) {
+            __m128i pair = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i both = _mm_shuffle_epi32(pair, _MM_SHUFFLE(2, 2, 0, 0));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dest + i), both);
+            _mm_storeh_pd(reinterpret_cast<double*>(dest + i + 1), _mm_castsi128_pd(both));
+        }
+#endif
+        for (; i < n; ++i) double_ptr_store(dest + i, src[i].handles[0]);
+    }
+    static void double_copy_backward(SnapPtr* dest, const SnapPtr* src, size_t n)
+    {
+        size_t i = n;
+#ifdef RANGE_SSE2
+        for (; i >= 2; i -= 2) {
+            __m128i pair = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i - 2));
+            __m128i both = _mm_shuffle_epi32(pair, _MM_SHUFFLE(2, 2, 0, 0));
+            _mm_storeh_pd(reinterpret_cast<double*>(dest + i - 1), _mm_castsi128_pd(both));
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dest + i - 2), both);
+        }
+#endif
+        while (i > 0) {
+            --i;
+            double_ptr_store(dest + i, src[i].handles[0]);
+        }
+    }
+    static void double_fill(SnapPtr* dest, Handle v, size_t n)
+    {
+        size_t i = 0;
+#ifdef RANGE_SSE2
+        __m128i both = _mm_set1_epi32((int)v);
+        for (; i + 2 <= n; i += 2) {
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(dest + i), both);
+            _mm_storeh_pd(reinterpret_cast<double*>(dest + i + 1), _mm_castsi128_pd(both));
+        }
+#endif
+        for (; i < n; ++i) double_ptr_store(dest + i, v);
+    }
+
+    //during a collection the snapshot halves have to be left alone, except in fresh pointers which keep both in step
+    static void collecting_copy_forward(MutatorContext* ctx, SnapPtr* dest, const SnapPtr* src, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i) collecting_ptr_store(ctx, dest + i, src[i].handles[0]);
+    }
+    static void collecting_copy_backward(MutatorContext* ctx, SnapPtr* dest, const SnapPtr* src, size_t n)
+    {
+        while (n > 0) {
+            --n;
+            collecting_ptr_store(ctx, dest + n, src[n].handles[0]);
         }
-        else write_barrier = regular_write_barrier;
     }
 
+    const size_t RangeChunk = 1024;
+
+    void copy_range(SnapPtr* dest, const SnapPtr* src, size_t n)
+    {
+        MutatorContext* ctx = ThreadContext;
+        assert(ctx->phase != PhaseEnum::NOT_MUTATING);
+        for (size_t done = 0; done < n;) {
+            size_t c = n - done < RangeChunk ? n - done : RangeChunk;
+            check_not_frozen(dest + done);
+            if (ctx->phase == PhaseEnum::COLLECTING) collecting_copy_forward(ctx, dest + done, src + done, c);
+            else double_copy_forward(dest + done, src + done, c);
+            done += c;
+            if (done < n) safe_point(ctx);
+        }
+    }
+
+    void move_range(SnapPtr* dest, const SnapPtr* src, size_t n)
+    {
+        if (dest == src || n == 0) return;
+        if (dest < src || dest >= src + n) {
+            copy_range(dest, src, n);
+            return;
+        }
+        //the ranges overlap with the destination above the source, so copy from the top down
+        MutatorContext* ctx = ThreadContext;
+        assert(ctx->phase != PhaseEnum::NOT_MUTATING);
+        for (size_t left = n; left > 0;) {
+            size_t c = left < RangeChunk ? left : RangeChunk;
+            left -= c;
+            check_not_frozen(dest + left);
+            if (ctx->phase == PhaseEnum::COLLECTING) collecting_copy_backward(ctx, dest + left, src + left, c);
+            else double_copy_backward(dest + left, src + left, c);
+            if (left > 0) safe_point(ctx);
+        }
+    }
+
+    void fill_range(SnapPtr* dest, Handle v, size_t n)
+    {
+        MutatorContext* ctx = ThreadContext;
+        assert(ctx->phase != PhaseEnum::NOT_MUTATING);
+        for (size_t done = 0; done < n;) {
+            size_t c = n - done < RangeChunk ? n - done : RangeChunk;
+            check_not_frozen(dest + done);
+            if (ctx->phase == PhaseEnum::COLLECTING) {
+                for (size_t i = 0; i < c; ++i) collecting_ptr_store(ctx, dest + done + i, v);
+            }
+            else double_fill(dest + done, v, c);
+            done += c;
+            if (done < n) safe_point(ctx);
+        }
+    }
 
     std::atomic_uint32_t ThreadsInGC;
 
@@ -242,19 +355,81 @@ namespace GC {
             if (nullptr == ScanListsByThread[i]) continue;
             Collectable* active_c = ScanListsByThread[i]->collectables[ActiveIndex];
             Collectable* snapshot_c = ScanListsByThread[i]->collectables[(ActiveIndex^1)];
+            //everything in the active list so far was created during the collection phase
+            ScanListsByThread[i]->first_fresh_collectable = static_cast<Collectable*>(active_c->circular_double_list_next);
             merge_from_to(snapshot_c, active_c);
             //save the start before any new allocations
             ScanListsByThread[i]->collectables[2]= static_cast<Collectable *>(ScanListsByThread[i]->collectables[ActiveIndex]->circular_double_list_next);
             
             RootLetterBase* active_r = ScanListsByThread[i]->roots[ActiveIndex];
             RootLetterBase* snapshot_r = ScanListsByThread[i]->roots[(ActiveIndex ^ 1)];
+            ScanListsByThread[i]->first_fresh_root = static_cast<RootLetterBase*>(active_r->circular_double_list_next);
             merge_from_to(snapshot_r, active_r);
 
             ScanListsByThread[i]->roots[2] = static_cast<RootLetterBase*>(ScanListsByThread[i]->roots[ActiveIndex]->circular_double_list_next);
+
+            merge_from_to(ScanListsByThread[i]->leaves[(ActiveIndex ^ 1)], ScanListsByThread[i]->leaves[ActiveIndex]);
         }
  
     }
 
+    //The sweep only unlinks dead objects and frees their handles, their destructors run on FinalizerThread afterwards,
+    //one batch per collection.  The next collection waits for the batch to be done before it starts marking, so that
+    //no dead WeakHolder is still registered by then.  Without a finalizer thread (GC::init(true)) the collector runs
+    //the batch itself right after the sweep.
+    //The handles are freed in the sweep because the handle free list is only safe to touch from the collector, so a
+    //handle can be handed out again while its old object still waits for its destructor.  That's harmless: nothing
+    //can reach a dead object by its handle any more, and destructors don't use their own handle.
+    std::vector<Collectable*> FinalizeBatch;
+    std::mutex FinalizeLock;
+    std::condition_variable FinalizeEvent;
+    //the batch handed over, and whether the finalizer is still working on it
+    std::vector<Collectable*> Finalizing;
+    bool FinalizerBusy = false;
+    bool FinalizerExit = false;
+    std::thread FinalizerThread;
+
+    //The destructors run with ThreadContext set to FinalizerContext, whichever thread runs them, so nothing they do
+    //reads or changes the state of a thread slot.  Without that the finalizer thread would be using slot 0, which
+    //belongs to a live mutator.
+    void finalize(std::vector<Collectable*>& batch)
+    {
+        MutatorContext* ctx = ThreadContext;
+        ThreadContext = &FinalizerContext;
+        for (Collectable* c : batch) c->collectable_finalize();
+        batch.clear();
+        ThreadContext = ctx;
+    }
+    void finalizer_thread()
+    {
+        std::unique_lock<std::mutex> g(FinalizeLock);
+        for (;;) {
+            FinalizeEvent.wait(g, [] { return FinalizerBusy || FinalizerExit; });
+            if (!FinalizerBusy) return;
+            g.unlock();
+            finalize(Finalizing);
+            g.lock();
+            FinalizerBusy = false;
+            FinalizeEvent.notify_all();
+        }
+    }
+    void wait_for_finalizer()
+    {
+        std::unique_lock<std::mutex> g(FinalizeLock);
+        FinalizeEvent.wait(g, [] { return !FinalizerBusy; });
+    }
+    void start_finalizer()
+    {
+        if (!FinalizerThread.joinable()) {
+            finalize(FinalizeBatch);
+            return;
+        }
+        std::lock_guard<std::mutex> g(FinalizeLock);
+        Finalizing.swap(FinalizeBatch);
+        FinalizerBusy = true;
+        FinalizeEvent.notify_all();
+    }
+
     void collect_thread();
     void init_handle_blocks();
 
@@ -272,9 +447,11 @@ namespace GC {
             ScanListsByThread[i] = nullptr;
             ThreadSlots[i] = false;
         }
+        FinalizerContext.thread_number = -1;
         TriggerPoint = 300000000;
         if (!combine_thread) {
             CollectionThread = std::thread(collect_thread);
+            FinalizerThread = std::thread(finalizer_thread);
         }
         else {
             init_thread(true);
@@ -287,6 +464,14 @@ namespace GC {
         SendCollectionEvent();
 
         if (!CombinedThread) CollectionThread.join();
+        if (FinalizerThread.joinable()) {
+            {
+                std::lock_guard<std::mutex> g(FinalizeLock);
+                FinalizerExit = true;
+                FinalizeEvent.notify_all();
+            }
+            FinalizerThread.join();
+        }
     }
 
     /*
@@ -302,9 +487,219 @@ namespace GC {
         return true
     
     */
+    //Every WeakHolder, in the list of the thread slot that registered it so mutators don't contend over registering.
+    //A holder remembers its list, it can be destroyed on another thread.
+    struct alignas(CacheLineSize) WeakHolderList
+    {
+        std::mutex lock;
+        WeakHolder* first = nullptr;
+    };
+    WeakHolderList WeakHolderLists[MAX_COLLECTED_THREADS];
+    //Handles that mutators read out of weak slots while collecting, until the collector has finished marking, see
+    //weak_load().  Each thread slot has its own log so mutators don't contend with each other, the collector takes all
+    //the locks at once only to hand the logs over.  WeakReadsTaken is written with every lock held.
+    struct alignas(CacheLineSize) WeakReadLog
+    {
+        std::mutex lock;
+        std::vector<Handle> reads;
+    };
+    WeakReadLog WeakReadLogs[MAX_COLLECTED_THREADS];
+    bool WeakReadsTaken = false;
+    //One past the highest thread slot ever handed out, so the collector only visits logs and holder lists that can
+    //have been used.  Slot 0 counts from the start, it's MutatorContexts[0], which ThreadContext defaults to.  It
+    //never goes down, the log of a thread that has exited can still hold reads.  init_thread raises it under
+    //WeakSlotsLock, which the collector holds while it has the logs locked, so no thread can join half way through.
+    std::mutex WeakSlotsLock;
+    int WeakSlots = 1;
+
+    static int used_weak_slots()
+    {
+        std::lock_guard<std::mutex> g(WeakSlotsLock);
+        return WeakSlots;
+    }
+    static void lock_weak_read_logs()
+    {
+        WeakSlotsLock.lock();
+        for (int i = 0; i < WeakSlots; ++i) WeakReadLogs[i].lock.lock();
+    }
+    static void unlock_weak_read_logs()
+    {
+        for (int i = WeakSlots - 1; i >= 0; --i) WeakReadLogs[i].lock.unlock();
+        WeakSlotsLock.unlock();
+    }
+    static void use_weak_slot(int n)
+    {
+        std::lock_guard<std::mutex> g(WeakSlotsLock);
+        if (WeakSlots <= n) WeakSlots = n + 1;
+    }
+
+    void WeakHolder::weak_register()
+    {
+        weak_registered = true;
+        //the finalizer's context has no slot of its own
+        weak_list = ThreadContext->thread_number < 0 ? 0 : ThreadContext->thread_number;
+        WeakHolderList& l = WeakHolderLists[weak_list];
+        std::lock_guard<std::mutex> g(l.lock);
+        weak_prev = nullptr;
+        weak_next = l.first;
+        if (weak_next != nullptr) weak_next->weak_prev = this;
+        l.first = this;
+    }
+    void WeakHolder::weak_unregister()
+    {
+        if (!weak_registered) return;
+        weak_registered = false;
+        WeakHolderList& l = WeakHolderLists[weak_list];
+        std::lock_guard<std::mutex> g(l.lock);
+        if (weak_prev != nullptr) weak_prev->weak_next = weak_next;
+        else l.first = weak_next;
+        if (weak_next != nullptr) weak_next->weak_prev = weak_prev;
+    }
+
+    //Until the collector has finished marking, anything read out of a weak slot is logged and marked along with what the
+    //snapshot reached.  After that nothing can be brought back, the object is returned only if it isn't dying.
+    //Outside of collections weak_load() doesn't get here.
+    //The slot is read under the thread's log lock so that the collector, by taking every lock once after clearing the
+    //slots, knows no mutator is still looking at an object it is about to free.
+    static Handle weak_read_locked(WeakReadLog& log, Handle h)
+    {
+        if (h == NULLHandle) return h;
+        if (!WeakReadsTaken) {
+            log.reads.push_back(h);
+            return h;
+        }
+        return is_dying(h) ? NULLHandle : h;
+    }
+    Handle weak_load_collecting(const std::atomic<Handle>& slot)
+    {
+        WeakReadLog& log = WeakReadLogs[ThreadContext->thread_number];
+        std::lock_guard<std::mutex> g(log.lock);
+        return weak_read_locked(log, slot.load(std::memory_order_acquire));
+    }
+    Handle weak_read_collecting(Handle h)
+    {
+        WeakReadLog& log = WeakReadLogs[ThreadContext->thread_number];
+        std::lock_guard<std::mutex> g(log.lock);
+        return weak_read_locked(log, h);
+    }
+
+    //roots of the objects passed to freeze() since the collector last took them.  Each request holds its own root
+    //letter so the caller can drop theirs right away, the collector lets go of it once the request is handled.
+    std::mutex FreezeLock;
+    std::vector<RootLetter<Collectable>*> FreezeRequests;
+
+    void freeze(Collectable* root)
+    {
+        RootLetter<Collectable>* r = new RootLetter<Collectable>(root);
+        std::lock_guard<std::mutex> g(FreezeLock);
+        FreezeRequests.push_back(r);
+    }
+    void make_immortal(Collectable* c)
+    {
+        freeze(c);
+    }
+
+    //Runs in the pause at the end of the collecting phase, after merge_collected(), while every mutator is stopped at a
+    //safe point or not mutating.  No store can be under way, so the FrozenTags go in with plain stores, and a store that
+    //comes after them sees them and is rejected.  The sweep is over by then, and everything that can be reached from a
+    //request through current values survived it, either marked or made since the collection started.  Frozen objects
+    //are marked from here on, the restore passes skip them and the next sweep moves them into ScanLists::frozen.
+    void freeze_requested()
+    {
+        std::vector<RootLetter<Collectable>*> requests;
+        {
+            std::lock_guard<std::mutex> g(FreezeLock);
+            requests.swap(FreezeRequests);
+        }
+        std::vector<Collectable*> stack;
+        for (RootLetter<Collectable>* r : requests) {
+            stack.push_back(r->value.get_collectable());
+            r->owned = false;//removed by the next collection's root pass
+        }
+        while (!stack.empty()) {
+            Collectable* c = stack.back();
+            stack.pop_back();
+            if (c == collectable_null || c->collectable_frozen) continue;
+            c->collectable_marked = true;
+            c->collectable_frozen = true;
+            for (int j = c->total_instance_vars() - 1; j >= 0; --j) {
+                InstancePtrBase* b = c->index_into_instance_vars(j);
+                if (b == nullptr) continue;
+                Handle n = b->value.handles[0];
+                b->value.handles[1] = n | FrozenTag;
+                stack.push_back(Handles[n].ptr);
+            }
+        }
+    }
+
+    //Weak slots are cleared after marking, which ends with the objects logged by weak_load() and the ephemerons.  The
+    //logs are handed over in one go: every log lock is taken once, the logged reads and the ephemerons are marked and
+    //WeakReadsTaken is set, so nothing can be logged that isn't marked.  The other time the locks are taken is after
+    //clear_dying(), as a barrier, because a mutator that read a slot before it was cleared can still be looking at
+    //the object in is_dying() and the sweep is about to reuse its handle.
+    //With no holders left there is nothing to clear, but objects read before the last holder went away still have to
+    //be marked, a mutator can be holding one in a root made since the collection started.  That's rare enough that
+    //the lists are condemned with the locks held then, when there are holders it's done before taking them.
+    void clear_weak_references()
+    {
+        bool holders = false;
+        for (int i = 0, n = used_weak_slots(); i < n && !holders; ++i) {
+            std::lock_guard<std::mutex> g(WeakHolderLists[i].lock);
+            holders = WeakHolderLists[i].first != nullptr;
+        }
+        //the unmarked objects in the lists being swept, so that is_dying() can tell them from the objects made since
+        //the collection started, which aren't marked either
+        auto condemn_unmarked = [] {
+            for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
+                if (nullptr == ScanListsByThread[i]) continue;
+                for (Collectable* list : { ScanListsByThread[i]->collectables[(ActiveIndex ^ 1)], ScanListsByThread[i]->leaves[(ActiveIndex ^ 1)] }) {
+                    auto itc = list->iterate();
+                    while (++itc) {
+                        Collectable* c = static_cast<Collectable*>(&*itc);
+                        if (!c->collectable_marked && c != collectable_null) c->collectable_condemned = true;
+                    }
+                }
+            }
+        };
+        if (holders) condemn_unmarked();
+        lock_weak_read_logs();
+        bool reads = false;
+        for (int i = 0; i < WeakSlots; ++i) if (!WeakReadLogs[i].reads.empty()) reads = true;
+        if (!holders && reads) condemn_unmarked();
+        for (int i = 0; i < WeakSlots; ++i) {
+            for (Handle h : WeakReadLogs[i].reads) {
+                Collectable* c = Handles[h].ptr;
+                if (is_dying(c)) c->collectable_mark();
+            }
+            WeakReadLogs[i].reads.clear();
+        }
+        if (holders) {
+            //nothing can be logged while the logs are locked, marking is finished when no ephemeron marks anything more
+            bool more = true;
+            while (more) {
+                more = false;
+                for (int i = 0; i < WeakSlots; ++i) {
+                    std::lock_guard<std::mutex> h(WeakHolderLists[i].lock);
+                    for (WeakHolder* w = WeakHolderLists[i].first; w != nullptr; w = w->weak_next) if (w->mark_ephemerons()) more = true;
+                }
+            }
+        }
+        WeakReadsTaken = true;
+        unlock_weak_read_logs();
+        if (!holders) return;
+        for (int i = 0, n = used_weak_slots(); i < n; ++i) {
+            std::lock_guard<std::mutex> g(WeakHolderLists[i].lock);
+            for (WeakHolder* w = WeakHolderLists[i].first; w != nullptr; w = w->weak_next) w->clear_dying();
+        }
+        //wait out any weak_load() that read a slot before it was cleared
+        lock_weak_read_logs();
+        unlock_weak_read_logs();
+    }
+
     void FreeThreadHandlesInGC();
     void _do_collection() 
     {
+        wait_for_finalizer();
         FreeThreadHandlesInGC();
         int cr = 0, rr = 0;
         //mark
@@ -325,49 +720,57 @@ namespace GC {
             }
 
         }
+        if (exit_program_flag) return;
+        clear_weak_references();
         //sweep
         for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
             if (nullptr == ScanListsByThread[i]) continue;
-            auto itc = ScanListsByThread[i]->collectables[(ActiveIndex ^ 1)]->iterate();
-            while (++itc) {
-                if (exit_program_flag) return;
-                if (!static_cast<Collectable*>(&*itc)->collectable_marked && &*itc!= collectable_null) {
-                    itc.remove();
-                    ++cr;
-                }
-                else {
-                    static_cast<Collectable*>(&*itc)->collectable_marked = false;
-                    static_cast<Collectable*>(&*itc)->clean_after_collect();
+            for (Collectable* list : { ScanListsByThread[i]->collectables[(ActiveIndex ^ 1)], ScanListsByThread[i]->leaves[(ActiveIndex ^ 1)] }) {
+                auto itc = list->iterate();
+                while (++itc) {
+                    if (exit_program_flag) return;
+                    if (static_cast<Collectable*>(&*itc)->collectable_frozen) itc.move_to(ScanListsByThread[i]->frozen);
+                    else if (!static_cast<Collectable*>(&*itc)->collectable_marked && &*itc != collectable_null) {
+                        Collectable* dead = static_cast<Collectable*>(&*itc);
+                        itc.unlink();
+                        DeallocHandleInGC(dead->myHandle);
+                        FinalizeBatch.push_back(dead);
+                        ++cr;
+                    }
+                    else {
+                        static_cast<Collectable*>(&*itc)->collectable_condemned = false;
+                        static_cast<Collectable*>(&*itc)->collectable_marked = false;
+                        static_cast<Collectable*>(&*itc)->clean_after_collect();
+                    }
                 }
             }
-
         }
+        start_finalizer();
         std::cout << rr << " roots removed " << cr << " objects removed\n";
     }
 
 
+    //This pass always runs, even single threaded, because it is what clears the fresh tags left by the collection
+    //before, see FreshTag.
     void _do_restore_snapshot()
     {
-        //weird optimization that is only safe because of weird timing.
-        //this says "that if we got this far running single threaded, then the non-atomic restore snapshot had to be 100% effective
-        //and we don't need another scan to fix it."
-        //If ThreadsInGC didn't only change monotonically (it only counts up, never down) then this wouldn't be safe.
-        if (CombinedThread && ThreadsInGC == 1) return;
         for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
             if (nullptr == ScanListsByThread[i]) continue;
-            Collectable* snapshot_c = ScanListsByThread[i]->collectables[ActiveIndex];
+            Collectable* fresh_c = ScanListsByThread[i]->first_fresh_collectable;
             auto t = ScanListsByThread[i]->collectables[2]->iterate();
-            assert(t);
-            while (t) {
+            while (t && &*t != fresh_c) {
                 if (exit_program_flag) return;
-                for (int j = static_cast<Collectable*>(&*t)->total_instance_vars() - 1; j >= 0; --j) {
-                    fast_restore(&(static_cast<Collectable*>(&*t)->index_into_instance_vars(j)->value));
+                //frozen objects keep their FrozenTags until the next sweep moves them out of this list
+                if (!static_cast<Collectable*>(&*t)->collectable_frozen) {
+                    for (int j = static_cast<Collectable*>(&*t)->total_instance_vars() - 1; j >= 0; --j) {
+                        fast_restore(&(static_cast<Collectable*>(&*t)->index_into_instance_vars(j)->value));
+                    }
                 }
                 ++t;
             }            
+            RootLetterBase* fresh_r = ScanListsByThread[i]->first_fresh_root;
             t = ScanListsByThread[i]->roots[2]->iterate();
-            assert(t);
-            while (t) {
+            while (t && &*t != fresh_r) {
                 if (exit_program_flag) return;
                 fast_restore(static_cast<RootLetterBase*>(&*t)->double_ptr());
                 ++t;
@@ -377,22 +780,27 @@ namespace GC {
     void _do_finalize_snapshot()
     {
         //std::cout << "actually about to finalize snapshot \n";
+        //weird optimization that is only safe because of weird timing.
+        //this says "that if we got this far running single threaded, then the non-atomic restore snapshot had to be 100% effective
+        //and we don't need another scan to fix it."
+        //If ThreadsInGC didn't only change monotonically (it only counts up, never down) then this wouldn't be safe.
         if (CombinedThread && ThreadsInGC == 1) return;
         for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
             if (nullptr == ScanListsByThread[i]) continue;
             if (exit_program_flag) return;
-            Collectable* snapshot_c = ScanListsByThread[i]->collectables[ActiveIndex];
+            Collectable* fresh_c = ScanListsByThread[i]->first_fresh_collectable;
             auto t = ScanListsByThread[i]->collectables[2]->iterate();
-            assert(t);
-            while (t) {
-                for (int j = static_cast<Collectable*>(&*t)->total_instance_vars() - 1; j >= 0; --j) {
-                    restore(&(static_cast<Collectable*>(&*t)->index_into_instance_vars(j)->value));
+            while (t && &*t != fresh_c) {
+                if (!static_cast<Collectable*>(&*t)->collectable_frozen) {
+                    for (int j = static_cast<Collectable*>(&*t)->total_instance_vars() - 1; j >= 0; --j) {
+                        restore(&(static_cast<Collectable*>(&*t)->index_into_instance_vars(j)->value));
+                    }
                 }
                 ++t;
             }
+            RootLetterBase* fresh_r = ScanListsByThread[i]->first_fresh_root;
             t = ScanListsByThread[i]->roots[2]->iterate();
-            assert(t);
-            while (t) {
+            while (t && &*t != fresh_r) {
                 restore(static_cast<RootLetterBase*>(&*t)->double_ptr());
                 ++t;
             }
@@ -433,7 +841,7 @@ namespace GC {
 #endif 
             to = get_state();
         }
-        if (CombinedThread && ThreadState !=PhaseEnum::NOT_MUTATING)  SetThreadState(PhaseEnum::COLLECTING);
+        if (CombinedThread && ThreadContext->phase != PhaseEnum::NOT_MUTATING)  SetThreadState(PhaseEnum::COLLECTING);
         _do_collection();
     }
     //waits until no threads are collecting
@@ -453,7 +861,15 @@ namespace GC {
         bool one_shot = false;
         while (true) {
             if (to.state.threads_in_collection == 1) {
-                if (!one_shot) merge_collected();
+                if (!one_shot) {
+                    merge_collected();
+                    freeze_requested();
+                    //no thread is collecting any more, the next collection starts with empty logs
+                    lock_weak_read_logs();
+                    for (int i = 0; i < WeakSlots; ++i) WeakReadLogs[i].reads.clear();
+                    WeakReadsTaken = false;
+                    unlock_weak_read_logs();
+                }
                 one_shot = true;
  
                 do {
@@ -470,7 +886,7 @@ namespace GC {
 #endif 
             to = get_state();
         }
-        if (CombinedThread && ThreadState != PhaseEnum::NOT_MUTATING)  SetThreadState(PhaseEnum::RESTORING_SNAPSHOT);
+        if (CombinedThread && ThreadContext->phase != PhaseEnum::NOT_MUTATING)  SetThreadState(PhaseEnum::RESTORING_SNAPSHOT);
         _do_restore_snapshot();
         return;
     }
@@ -506,7 +922,7 @@ namespace GC {
 #endif 
             to = get_state();
         }
-        if (CombinedThread && ThreadState != PhaseEnum::NOT_MUTATING)  SetThreadState(PhaseEnum::NOT_COLLECTING);
+        if (CombinedThread && ThreadContext->phase != PhaseEnum::NOT_MUTATING)  SetThreadState(PhaseEnum::NOT_COLLECTING);
         _do_finalize_snapshot();
 
     }
@@ -528,7 +944,7 @@ namespace GC {
     //
     //count into collection to start gc or count out of collection to start sweep
     //
-    void safe_point()
+    void safe_point(MutatorContext* ctx)
     {
         if (CombinedThread) {
             if (single_thread_event ) {
@@ -538,8 +954,8 @@ namespace GC {
         }
         StateStoreType gc = get_state();
         StateStoreType to;
-        if (ThreadState == gc.state.phase) return;
-        switch (ThreadState)
+        if (ctx->phase == gc.state.phase) return;
+        switch (ctx->phase)
         {
         case PhaseEnum::NOT_MUTATING:
             return;
@@ -554,7 +970,7 @@ namespace GC {
 
                 success = compare_set_state(&gc, to);
             } while (!success);
-            SetThreadState(PhaseEnum::RESTORING_SNAPSHOT);
+            SetThreadState(ctx, PhaseEnum::RESTORING_SNAPSHOT);
             while (to.state.threads_in_collection > 0) {
 #ifdef _WIN32
                 if (exit_program_flag) return;
@@ -577,7 +993,7 @@ namespace GC {
 
                 success = compare_set_state(&gc, to);
             } while (!success);
-            SetThreadState(PhaseEnum::NOT_COLLECTING);
+            SetThreadState(ctx, PhaseEnum::NOT_COLLECTING);
             while (to.state.threads_in_sweep > 0) {
 #ifdef _WIN32
                 SwitchToThread();
@@ -598,7 +1014,7 @@ namespace GC {
                 to.state.threads_out_of_collection--;
                 success = compare_set_state(&gc, to);
             } while (!success);
-            SetThreadState(PhaseEnum::COLLECTING);
+            SetThreadState(ctx, PhaseEnum::COLLECTING);
             while (to.state.threads_out_of_collection > 0) {
 #ifdef _WIN32
                 SwitchToThread();
@@ -608,6 +1024,8 @@ namespace GC {
                 to = get_state();
                 if (exit_program_flag) return;
             }
+            //ActiveIndex has flipped by now
+            ctx->fresh_tag = current_fresh_tag();
             break;
         }
         }
@@ -615,55 +1033,58 @@ namespace GC {
 
     void init_thread(bool combine_thread)
     {
-        MyThreadNumber = -1;
+        int my_thread_number = -1;
         do {
             for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
                 bool expected = false;
                 if (ThreadSlots[i] == false && ThreadSlots[i].compare_exchange_strong(expected, true)) {
-                    MyThreadNumber = i;
+                    my_thread_number = i;
                     break;
                 }
             }
-            if (MyThreadNumber == -1){
+            if (my_thread_number == -1){
 #ifdef _WIN32
                 SwitchToThread();
 #else
                 sched_yield();
 #endif         
             }
-        } while (MyThreadNumber == -1);
+        } while (my_thread_number == -1);
+
+        MutatorContext* ctx = &MutatorContexts[my_thread_number];
+        ctx->thread_number = my_thread_number;
+        ThreadContext = ctx;
+        use_weak_slot(my_thread_number);
 
         ThreadsInGC++;
-        if (ScanListsByThread[MyThreadNumber] == nullptr) {
+        if (ScanListsByThread[my_thread_number] == nullptr) {
             ScanLists* s = new ScanLists;
 
             for (int i = 0; i < 2; ++i) {
                 s->collectables[i] = Handles[(new CollectableSentinel())->getHandle()].ptr;
                 s->collectables[i]->circular_double_list_is_sentinel = true;
+                s->leaves[i] = Handles[(new CollectableSentinel())->getHandle()].ptr;
+                s->leaves[i]->circular_double_list_is_sentinel = true;
                 s->roots[i] = new RootLetterBase(_SENTINEL_);
             }
-            ScanListsByThread[MyThreadNumber] = s;
+            s->frozen = Handles[(new CollectableSentinel())->getHandle()].ptr;
+            s->frozen->circular_double_list_is_sentinel = true;
+            ScanListsByThread[my_thread_number] = s;
         }
+        ctx->scan_lists = ScanListsByThread[my_thread_number];
         CombinedThread = combine_thread;
 
-        NotMutatingCount = 1;
+        ctx->not_mutating_count = 1;
         thread_enter_mutation(true);
-
-        static bool SNilInit = false;
-        if (!SNilInit) {
-            SNilInit = true;
-            _SNil_ = new RootPtr<Sexp>;
-            SNil = new SexpNil;
-        }
     }
 
     void FreeThreadHandles();
     void exit_thread()
     {
         thread_leave_mutation();
-        alloc_merge();
+        alloc_merge(ThreadContext);
         FreeThreadHandles();
-        ThreadSlots[MyThreadNumber] = false;
+        ThreadSlots[ThreadContext->thread_number] = false;
 //        ThreadsInGC--; don't count out.  If we ever stop running single threaded, assume we'll never be single threaded again.
     }
 
@@ -677,8 +1098,9 @@ namespace GC {
     //
     void thread_leave_mutation()
     {
-        ++NotMutatingCount;
-        if (NotMutatingCount > 1) {
+        MutatorContext* ctx = ThreadContext;
+        ++ctx->not_mutating_count;
+        if (ctx->not_mutating_count > 1) {
             return;
         }
         bool success = false;
@@ -686,7 +1108,8 @@ namespace GC {
         do {
             StateStoreType to;
             to.state = gc.state;
-            switch (gc.state.phase) {
+            //uncount from the phase this thread is in, which lags the global phase until its next safe point
+            switch (ctx->phase) {
             case  PhaseEnum::NOT_COLLECTING:
                 --to.state.threads_out_of_collection;
                 break;
@@ -700,12 +1123,13 @@ namespace GC {
             ++to.state.threads_not_mutating;
             success = compare_set_state(&gc, to);
         } while (!success);
-        SetThreadState(PhaseEnum::NOT_MUTATING);
+        SetThreadState(ctx, PhaseEnum::NOT_MUTATING);
     }
     void thread_enter_mutation(bool from_init_thread)
     {
-        --NotMutatingCount;
-        if (NotMutatingCount != 0) {
+        MutatorContext* ctx = ThreadContext;
+        --ctx->not_mutating_count;
+        if (ctx->not_mutating_count != 0) {
             return;
         }
         bool success = false;
@@ -731,7 +1155,7 @@ namespace GC {
             }
             else success = compare_set_state(&gc, to);
         } while (!success);
-        SetThreadState(to.state.phase);
+        SetThreadState(ctx, to.state.phase);
         if (CombinedThread) return;
         switch (to.state.phase)
         {
@@ -756,6 +1180,8 @@ namespace GC {
                 to = get_state();
                 if (exit_program_flag) return;
             }
+            //ActiveIndex has flipped by now
+            ctx->fresh_tag = current_fresh_tag();
             break;
         case  PhaseEnum::RESTORING_SNAPSHOT:
             while (to.state.threads_in_collection > 0) {
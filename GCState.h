@@ -45,24 +45,13 @@ namespace GC {
     const int HandlesPerBlock = 16384;
     const int TotalHandles = HandlesPerBlock * 8192;//about 134 million
   
-    extern Handle HandleList[MAX_COLLECTED_THREADS];
     extern HandleType Handles[TotalHandles];
 
     extern int unqueued_handles;
     extern int prev_unqueued_handle;
 
-    extern thread_local int MyThreadNumber;
-
     int GrabHandleList();
 
-    inline Handle AllocateHandle()
-    {
-        Handle next = HandleList[MyThreadNumber];
-        if (next == EndOfHandleFreeList) next = GrabHandleList();
-        HandleList[MyThreadNumber] = Handles[next].list;
-        return next;
-    }
-
     inline void DeallocHandleInGC(int pos)
     {
         ++unqueued_handles;
@@ -80,8 +69,6 @@ namespace GC {
     const Handle NULLHandle = 0;//set the first handle to the nullptr
 
    
-    void log_alloc(size_t a);
-    void log_array_alloc(size_t a, size_t n);
 
     union SnapPtr {
         Handle     handles[2];
@@ -89,6 +76,33 @@ namespace GC {
     };
 
 
+    //The snapshot half of a SnapPtr can carry tag bits above the handle.  FreshTag marks a pointer that was constructed
+    //while its thread was in the COLLECTING phase, and FreshEpochBit records which collection that was (ActiveIndex at
+    //the time).  Anything that reads the snapshot as a handle has to mask the tags off, which load_snapshot() does.
+    //The epoch is one bit, so the tag of collection N comes round again at N+2.  That's safe only because every fresh
+    //tag is gone before then: the objects made during N are walked by the first restore pass of N+1, which copies the
+    //current half over the tagged snapshot half, and that pass runs in every collection, single threaded ones included.
+    //FrozenTag is in every pointer of a frozen object (see GC::freeze), the restore passes skip those so it stays.
+    const Handle FreshTag = 0x80000000;
+    const Handle FreshEpochBit = 0x40000000;
+    const Handle FrozenTag = 0x20000000;
+    const Handle SnapshotTagMask = FreshTag | FreshEpochBit | FrozenTag;
+    const Handle HandleMask = ~SnapshotTagMask;
+    static_assert((Handle)TotalHandles <= FrozenTag, "handles overlap the snapshot tags");
+
+    inline bool frozen_slot(const SnapPtr* dest)
+    {
+        return (dest->handles[1] & FrozenTag) != 0;
+    }
+    //Every store into an existing pointer goes through this.  A frozen object is never traced again, so whatever a
+    //store put into it could be freed under it: the store is rejected with std::logic_error and the pointer is left
+    //as it was.  Pointers only get their FrozenTag while every mutator is stopped, so the test can't race with it.
+    [[noreturn]] void frozen_store();
+    inline void check_not_frozen(const SnapPtr* dest)
+    {
+        if (frozen_slot(dest)) frozen_store();
+    }
+
     inline void double_ptr_store(SnapPtr* dest, Handle v)
     {
         SnapPtr temp;
@@ -106,7 +120,7 @@ namespace GC {
     }
     inline Handle load_snapshot(const SnapPtr* dest)
     {
-        return dest->handles[1];
+        return dest->handles[1] & HandleMask;
     }
 
     inline void fast_restore(SnapPtr* source)
@@ -131,8 +145,6 @@ namespace GC {
         } while (!reinterpret_cast<std::atomic_uint64_t*>(&source->combined)->compare_exchange_weak(temp.combined, desired.combined,std::memory_order_seq_cst));
     }
 
-    extern thread_local void (*write_barrier)(SnapPtr*, Handle);
-
     enum class PhaseEnum : std::uint8_t
     {
         NOT_MUTATING,
@@ -162,8 +174,207 @@ namespace GC {
 
     extern StateStoreType State;
 
-    extern thread_local PhaseEnum ThreadState;
-    extern thread_local int NotMutatingCount;
+    struct ScanLists;
+
+    const int CacheLineSize = 64;
+
+    //Everything a mutating thread touches on the allocation and write barrier fast paths lives in one
+    //MutatorContext.  There is one per thread slot, each padded out to its own cache lines so that threads
+    //allocating at the same time don't false share, and a thread reaches its own through the single
+    //thread_local pointer ThreadContext instead of through a separate thread_local per variable.
+    //Code that already has the context in hand can pass it explicitly to the overloads that take it.
+    //
+    //Before init_thread() is called a thread uses slot 0, which is what lets CollectableNull get handle 0
+    //during static initialization.
+    struct alignas(CacheLineSize) MutatorContext
+    {
+        //the head of this thread's private free list of handles, EndOfHandleFreeList when it needs another block
+        Handle handle_list;
+        //this thread's copy of the phase, NOT_MUTATING when it has opted out of mutation
+        PhaseEnum phase;
+        //FreshTag plus the epoch bit of the collection in progress, only meaningful while phase is COLLECTING
+        Handle fresh_tag;
+        //bytes allocated since this thread last added its count to the global one
+        int64_t allocated;
+        int aggregate_log_alloc;
+        int aggregate_array_log_alloc;
+        int handles_used;
+        int not_mutating_count;
+        int thread_number;
+        ScanLists* scan_lists;
+    };
+
+    extern MutatorContext MutatorContexts[MAX_COLLECTED_THREADS];
+    extern thread_local MutatorContext* ThreadContext;
+    //The context that destructors of swept objects run in, see GC::finalize.  It isn't a thread slot: its phase is
+    //always NOT_MUTATING and it has no scan lists, so the collector never waits for it or walks anything of it.
+    //A finalized destructor may free memory the object owns and unregister WeakHolders, nothing else of the GC's.
+    //It must not allocate collectables, make or destroy RootPtrs, or store into InstancePtrs, which all assert.
+    extern MutatorContext FinalizerContext;
+
+    inline Handle AllocateHandle(MutatorContext* ctx)
+    {
+        assert(ctx != &FinalizerContext);
+        Handle next = ctx->handle_list;
+        if (next == EndOfHandleFreeList) next = GrabHandleList();
+        ctx->handle_list = Handles[next].list;
+        return next;
+    }
+    inline Handle AllocateHandle()
+    {
+        return AllocateHandle(ThreadContext);
+    }
+
+    //Define SINGLE_PHASE_BARRIER for programs that only ever run with GC::init(true) and one mutating thread.
+    //There the whole collection happens inside safe_point(), so no store can land in the COLLECTING phase and
+    //every store can be a plain double store with no phase test at all.
+//#define SINGLE_PHASE_BARRIER
+
+    //Objects created during the COLLECTING phase go into the new list, so the collection in progress never traces them
+    //and there is no snapshot of them to protect.  Their pointers are constructed with the current fresh tag in the
+    //snapshot half.  A store that finds that tag writes both halves (keeping the tag), so a fresh object's snapshot
+    //always matches its current value and the restore passes can stop at the first fresh object instead of walking
+    //them all.  A stale tag from an earlier collection is ignored here and cleared by the next restore pass, which
+    //sees the halves differ.
+    inline void construct_ptr(MutatorContext* ctx, SnapPtr* dest, Handle v)
+    {
+#ifdef SINGLE_PHASE_BARRIER
+        double_ptr_store(dest, v);
+#else
+        SnapPtr temp;
+        temp.handles[0] = v;
+        temp.handles[1] = ctx->phase == PhaseEnum::COLLECTING ? (v | ctx->fresh_tag) : v;
+        reinterpret_cast<std::atomic_uint64_t*>(&dest->combined)->store(temp.combined, std::memory_order_relaxed);
+#endif
+    }
+    inline void construct_ptr(SnapPtr* dest, Handle v)
+    {
+        construct_ptr(ThreadContext, dest, v);
+    }
+
+    inline void collecting_ptr_store(MutatorContext* ctx, SnapPtr* dest, Handle v)
+    {
+        if ((dest->handles[1] & SnapshotTagMask) == ctx->fresh_tag) {
+            SnapPtr temp;
+            temp.handles[0] = v;
+            temp.handles[1] = v | ctx->fresh_tag;
+            reinterpret_cast<std::atomic_uint64_t*>(&dest->combined)->store(temp.combined, std::memory_order_relaxed);
+        }
+        else single_ptr_store(dest, v);
+    }
+
+    //The write barrier is an inline test of this thread's phase byte rather than a call through a pointer.
+    //The phase only changes at a safe point, so the branch goes the same way for millions of stores in a row
+    //and predicts almost perfectly.  While collecting only the current half is written so that the collector
+    //still sees the snapshot (unless the pointer is fresh, see above), otherwise both halves are written at once.
+    inline void write_barrier(MutatorContext* ctx, SnapPtr* dest, Handle v)
+    {
+        assert(ctx->phase != PhaseEnum::NOT_MUTATING);
+        check_not_frozen(dest);
+#ifdef SINGLE_PHASE_BARRIER
+        assert(ctx->phase != PhaseEnum::COLLECTING);
+        double_ptr_store(dest, v);
+#else
+        if (ctx->phase == PhaseEnum::COLLECTING) collecting_ptr_store(ctx, dest, v);
+        else double_ptr_store(dest, v);
+#endif
+    }
+    inline void write_barrier(SnapPtr* dest, Handle v)
+    {
+        write_barrier(ThreadContext, dest, v);
+    }
+
+    //Atomic read-modify-write versions of the write barrier, for lock free structures built out of collectable objects.
+    //The whole SnapPtr is updated with one 64 bit compare and swap: both halves get the new handle outside of collections,
+    //while collecting the snapshot half is kept (or kept in step if the pointer is fresh).  Only the current half takes
+    //part in the comparison, a change that only touched the snapshot half (the collector restoring it) just retries.
+    //Since a handle can't be reused while anything still holds the object it named, holding the expected value in a
+    //RootPtr is enough to rule out ABA without hazard pointers.
+    inline SnapPtr barrier_value(MutatorContext* ctx, SnapPtr old, Handle v)
+    {
+        SnapPtr ret;
+        ret.handles[0] = v;
+#ifdef SINGLE_PHASE_BARRIER
+        ret.handles[1] = v;
+#else
+        if (ctx->phase != PhaseEnum::COLLECTING) ret.handles[1] = v;
+        else if ((old.handles[1] & SnapshotTagMask) == ctx->fresh_tag) ret.handles[1] = v | ctx->fresh_tag;
+        else ret.handles[1] = old.handles[1];
+#endif
+        return ret;
+    }
+
+    inline Handle atomic_load_ptr(const SnapPtr* dest, std::memory_order order)
+    {
+        return reinterpret_cast<const std::atomic<Handle>*>(&dest->handles[0])->load(order);
+    }
+
+    inline void atomic_store_ptr(MutatorContext* ctx, SnapPtr* dest, Handle v, std::memory_order order)
+    {
+        assert(ctx->phase != PhaseEnum::NOT_MUTATING);
+        check_not_frozen(dest);
+        std::atomic_uint64_t* a = reinterpret_cast<std::atomic_uint64_t*>(&dest->combined);
+        SnapPtr old;
+        old.combined = a->load(std::memory_order_relaxed);
+        //while collecting, a single store of the current half leaves the snapshot alone by itself
+        if (ctx->phase == PhaseEnum::COLLECTING && (old.handles[1] & SnapshotTagMask) != ctx->fresh_tag) {
+            reinterpret_cast<std::atomic<Handle>*>(&dest->handles[0])->store(v, order);
+            return;
+        }
+        a->store(barrier_value(ctx, old, v).combined, order);
+    }
+
+    //returns the handle that was replaced
+    inline Handle exchange_ptr(MutatorContext* ctx, SnapPtr* dest, Handle v, std::memory_order order)
+    {
+        assert(ctx->phase != PhaseEnum::NOT_MUTATING);
+        check_not_frozen(dest);
+        std::atomic_uint64_t* a = reinterpret_cast<std::atomic_uint64_t*>(&dest->combined);
+        SnapPtr old;
+        old.combined = a->load(std::memory_order_relaxed);
+        while (!a->compare_exchange_weak(old.combined, barrier_value(ctx, old, v).combined, order, std::memory_order_relaxed)) {}
+        return old.handles[0];
+    }
+
+    //on failure expected is set to the current handle
+    inline bool compare_exchange_ptr(MutatorContext* ctx, SnapPtr* dest, Handle& expected, Handle desired, std::memory_order order)
+    {
+        assert(ctx->phase != PhaseEnum::NOT_MUTATING);
+        check_not_frozen(dest);
+        std::atomic_uint64_t* a = reinterpret_cast<std::atomic_uint64_t*>(&dest->combined);
+        SnapPtr old;
+        old.combined = a->load(std::memory_order_relaxed);
+        while (old.handles[0] == expected) {
+            if (a->compare_exchange_weak(old.combined, barrier_value(ctx, old, desired).combined, order, std::memory_order_relaxed)) return true;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        expected = old.handles[0];
+        return false;
+    }
+
+    //Bulk versions of the write barrier for runs of SnapPtrs: the same result as storing one element at a time,
+    //but with vector stores outside of collections and a safe point every 1024 elements.
+    //copy_range requires that the ranges don't overlap, move_range allows it, fill_range stores v everywhere.
+    void copy_range(SnapPtr* dest, const SnapPtr* src, size_t n);
+    void move_range(SnapPtr* dest, const SnapPtr* src, size_t n);
+    void fill_range(SnapPtr* dest, Handle v, size_t n);
+
+    void alloc_merge(MutatorContext* ctx);
+
+    //Once every 300 allocations within a thread or for every allocation over 500,000 bytes, it checks how much was allocated by all threads and triggers a garbage collect if it was beyond a threshold
+    inline void log_alloc(MutatorContext* ctx, size_t a)
+    {
+        ctx->allocated += a;
+        if (++ctx->aggregate_log_alloc > 300 || a > 500000) {
+            alloc_merge(ctx);
+        }
+    }
+    inline void log_alloc(size_t a)
+    {
+        log_alloc(ThreadContext, a);
+    }
+    void log_array_alloc(size_t a, size_t n);
+
     extern //thread_local 
         bool CombinedThread;
 
@@ -176,13 +387,16 @@ namespace GC {
     
     void exit_collect_thread();
     void init(bool combine_thread=false);
+    //starts a collection as if the allocation trigger had gone off, mutators join it at their next safe point
+    void request_collection();
     void _start_collection();
     //waits until no threads are collecting
     void _end_collection_start_sweep();
     void _end_sweep();
     StateStoreType get_state();
     bool compare_set_state(StateStoreType* expected, StateStoreType to);
-    void safe_point();
+    void safe_point(MutatorContext* ctx);
+    inline void safe_point() { safe_point(ThreadContext); }
     void init_thread(bool combine_thread=false);
     void exit_thread();
     struct ThreadRAII
@@ -44,7 +44,7 @@ enum SingletonEnum {
 	Singleton
 };
 
-class GraphemeString_letter : public Collectable
+class GraphemeString_letter : public CollectableLeaf
 {
 
 public:
@@ -83,10 +83,6 @@ public:
 
 	};
 
-	InstancePtrBase* index_into_instance_vars(int num) { return nullptr; }
-	int total_instance_vars() const { return 0; }
-
-
 	GraphemeString_letter(const GraphemeString& source) { load(source); };
 	GraphemeString_letter(const GraphemeString& src1, const GraphemeString& src2) { load(src1, src2); };
 };
@@ -4,12 +4,14 @@
 #include <iostream>
 #include <sstream>
 #include <random>
+#include <chrono>
 
 #include "CollectableHash.h"
+#include "CollectableQueue.h"
 
 static int64_t identity_counter = 0;
 
-class RandomCounted : public Collectable
+class RandomCounted final : public TriviallyFinalized<RandomCounted, Collectable, int, int64_t, InstancePtr<RandomCounted>>
 {
 public:
     int points_at_me;
@@ -34,11 +36,6 @@ public:
         second = o;
     }
     RandomCounted(int i) :points_at_me(0),identity(i) {}
-    ~RandomCounted()
-    {
-//        if (0 == points_at_me) std::cout << "Correct delete\n";
-//        else std::cout << "*** incorrect or cycle delete. Holds "<<points_at_me<<"\n";
-    }
     int total_instance_vars() const {
         MEM_TEST();
         return 2; }
@@ -60,7 +57,7 @@ RootPtr<CollectableString> int_to_string(int a)
 {
     std::stringstream ss;
     ss << a;
-    return new CollectableString(ss.str().c_str());
+    return GC::intern(ss.str().c_str());
 }
 
 void mutator_thread()
@@ -156,12 +153,165 @@ void mutator_thread()
     }
 }
 
+//Measures InstancePtr stores per second with the barrier in each of the two phases a mutator stores in.
+//The COLLECTING loop runs inside a real collection: there is no safe point in the timed loop, so once this thread
+//has counted into the collection it stays in COLLECTING until the safe point after the loop, and the collector
+//waits for it there.  A combined thread collects entirely inside safe_point(), so it never stores while collecting.
+void barrier_benchmark()
+{
+    GC::ThreadRAII threadholder;
+    const int64_t stores = 100000000;
+
+    RootPtr<RandomCounted> holder = new RandomCounted(-1);
+    RootPtr<RandomCounted> a = new RandomCounted(-2);
+    RootPtr<RandomCounted> b = new RandomCounted(-3);
+    RandomCounted* h = holder.get();
+    RandomCounted* targets[2] = { a.get(), b.get() };
+
+    GC::MutatorContext* ctx = GC::ThreadContext;
+    const GC::PhaseEnum phases[2] = { GC::PhaseEnum::NOT_COLLECTING, GC::PhaseEnum::COLLECTING };
+    const char* names[2] = { "not collecting", "collecting" };
+    for (int p = 0; p < 2; ++p) {
+        if (phases[p] == GC::PhaseEnum::COLLECTING) {
+            if (GC::CombinedThread) break;
+            GC::request_collection();
+        }
+        GC::safe_point();
+        while (ctx->phase != phases[p]) {
+            std::this_thread::yield();
+            GC::safe_point();
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (int64_t i = 0; i < stores; ++i) {
+            h->first = targets[i & 1];
+        }
+        auto end = std::chrono::steady_clock::now();
+        GC::safe_point();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << "write barrier " << names[p] << ": " << (stores / seconds) / 1e6 << " million stores/sec\n";
+    }
+}
+
+//Mixed lookups and inserts on one ConcurrentCollectableHashMap from 1 to 32 threads, 90% lookups.
+//Every thread makes its own key objects for the same strings, so they find each other's entries.
+//The threads wait for each other before starting so that building the keys isn't timed.
+void concurrent_map_worker(ConcurrentCollectableHashMap<CollectableString, RandomCounted>* map, int seed, int ops, std::atomic_int* ready, std::atomic_bool* go)
+{
+    GC::ThreadRAII threadholder;
+    const int keys = 16384;
+    std::vector<RootPtr<CollectableString>> key(keys);
+    for (int i = 0; i < keys; ++i) {
+        std::stringstream s;
+        s << "key" << i;
+        key[i] = CollectableString::make(s.str().c_str());
+    }
+    std::default_random_engine generator(seed);
+    ++*ready;
+    while (!*go) GC::safe_point();
+    for (int i = 0; i < ops; ++i) {
+        int k = generator() % keys;
+        if (generator() % 10 == 0) map->insert_or_assign(key[k], new RandomCounted(i));
+        else map->contains(key[k]);
+    }
+}
+
+void concurrent_map_benchmark()
+{
+    GC::ThreadRAII threadholder;
+    const int ops = 200000;
+    RootPtr<ConcurrentCollectableHashMap<CollectableString, RandomCounted>> map = new ConcurrentCollectableHashMap<CollectableString, RandomCounted>();
+    for (int threads = 1; threads <= 32; threads <<= 1) {
+        std::atomic_int ready(0);
+        std::atomic_bool go(false);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) workers.push_back(std::thread(concurrent_map_worker, map.get(), t + 1, ops, &ready, &go));
+        while (ready < threads) GC::safe_point();
+        auto start = std::chrono::steady_clock::now();
+        go = true;
+        {
+            GC::LeaveMutationRAII leave;
+            for (auto& w : workers) w.join();
+        }
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << "concurrent map " << threads << " threads: " << (threads * (double)ops / seconds) / 1e6 << " million ops/sec, " << map->size() << " keys\n";
+    }
+}
+
+//One CollectableMPMCQueue shared by 1 to 16 producers and as many consumers.  Every producer enqueues ops items taken
+//round robin from a pool it made before starting, and the consumers dequeue until all of them have been taken.  The
+//identities taken are summed to check that nothing was lost or taken twice.
+const int QueuePool = 1024;
+void queue_producer(CollectableMPMCQueue<RandomCounted>* q, int seed, int ops, std::atomic_int* ready, std::atomic_bool* go)
+{
+    GC::ThreadRAII threadholder;
+    std::vector<RootPtr<RandomCounted>> pool(QueuePool);
+    for (int i = 0; i < QueuePool; ++i) pool[i] = new RandomCounted(seed * QueuePool + i);
+    ++*ready;
+    while (!*go) GC::safe_point();
+    for (int i = 0; i < ops; ++i) {
+        GC::safe_point();
+        q->enqueue(pool[i % QueuePool]);
+    }
+}
+void queue_consumer(CollectableMPMCQueue<RandomCounted>* q, std::atomic_int64_t* left, std::atomic_int64_t* sum, std::atomic_int* ready, std::atomic_bool* go)
+{
+    GC::ThreadRAII threadholder;
+    RootPtr<RandomCounted> item;
+    int64_t mine = 0;
+    ++*ready;
+    while (!*go) GC::safe_point();
+    while (left->load(std::memory_order_relaxed) > 0) {
+        GC::safe_point();
+        if (q->dequeue(item)) {
+            mine += item->identity;
+            --*left;
+        }
+    }
+    *sum += mine;
+}
+
+void queue_benchmark()
+{
+    GC::ThreadRAII threadholder;
+    const int ops = 200000;
+    RootPtr<CollectableMPMCQueue<RandomCounted>> q = new CollectableMPMCQueue<RandomCounted>();
+    for (int threads = 1; threads <= 16; threads <<= 1) {
+        std::atomic_int ready(0);
+        std::atomic_bool go(false);
+        std::atomic_int64_t left(threads * (int64_t)ops);
+        std::atomic_int64_t sum(0);
+        int64_t expected = 0;
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            for (int i = 0; i < ops; ++i) expected += (t + 1) * (int64_t)QueuePool + i % QueuePool;
+            workers.push_back(std::thread(queue_producer, q.get(), t + 1, ops, &ready, &go));
+            workers.push_back(std::thread(queue_consumer, q.get(), &left, &sum, &ready, &go));
+        }
+        while (ready < 2 * threads) GC::safe_point();
+        auto start = std::chrono::steady_clock::now();
+        go = true;
+        {
+            GC::LeaveMutationRAII leave;
+            for (auto& w : workers) w.join();
+        }
+        auto end = std::chrono::steady_clock::now();
+        assert(sum == expected && q->empty());
+        double seconds = std::chrono::duration<double>(end - start).count();
+        std::cout << "mpmc queue " << threads << " producers " << threads << " consumers: " << (threads * (double)ops / seconds) / 1e6 << " million items/sec" << (sum == expected ? "" : ", items lost") << "\n";
+    }
+}
+
 int main()
 {
     std::cout << "Hello World!\n";
-    
+
     GC::init();
 
+    barrier_benchmark();
+    concurrent_map_benchmark();
+    queue_benchmark();
+
    //auto m2 = std::thread(mutator_thread);
     mutator_thread();
     GC::exit_collect_thread();
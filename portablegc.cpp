@@ -12,7 +12,7 @@ namespace GC {
 
     //How handles are allocated...
     //A lock free LIFO is filled with blocks of 16k free handles
-    //whenever an object is created, each thread pulls from its list of up to 16 handles.
+    //whenever an object is created, each thread pulls from the free list in its MutatorContext.
     //When it's out of handles it pulls another block from the LIFO 
     //
     //The gc thread collects handles into 16k blocks and dumps those into the LIFO
@@ -23,7 +23,6 @@ namespace GC {
   
     LockFreeLIFO<Handle, HandleBlocks + MAX_COLLECTED_THREADS+1> HandleBlockQueue;
     LockFreeLIFO<Handle, MAX_COLLECTED_THREADS * 10000> ReleaseHandlesQueue;
-    Handle HandleList[MAX_COLLECTED_THREADS];
     HandleType Handles[TotalHandles];
 
     int unqueued_handles = 0;
@@ -32,13 +31,13 @@ namespace GC {
     void init_handle_blocks()
     {
         for (int i = 0; i < MAX_COLLECTED_THREADS; ++i) {
-            HandleList[i] = EndOfHandleFreeList;
+            MutatorContexts[i].handle_list = EndOfHandleFreeList;
         }
         for (int i = 1; i < TotalHandles; ++i)
         {
             DeallocHandleInGC(i);
         }
-        HandleList[0] = 1;
+        MutatorContexts[0].handle_list = 1;
         Handles[0].ptr = collectable_null;
         CollectableNull.myHandle = 0;
     }
@@ -55,12 +54,14 @@ namespace GC {
 
     void FreeThreadHandles()
     {
-        Handle next = HandleList[MyThreadNumber];
+        Handle next = ThreadContext->handle_list;
         if (next != EndOfHandleFreeList) {
-            int queue_pos = HandleBlockQueue.pop_free();
+            int queue_pos = ReleaseHandlesQueue.pop_free();
             if (queue_pos != -1) {
                 ReleaseHandlesQueue.all_links[queue_pos].data = next;
                 ReleaseHandlesQueue.push_fifo(queue_pos);
+                //the collector owns these now, a thread that reuses this slot has to grab a fresh block
+                ThreadContext->handle_list = EndOfHandleFreeList;
             }
         }
     }